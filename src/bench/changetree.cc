@@ -0,0 +1,301 @@
+/*
+ * Microbenchmarks for the change tree and the CHANGES emitter, over a set of
+ * tree shapes. Results are written as JSON so that runs can be compared
+ * across commits.
+ *
+ *   insert     events pushed through Manager::push_fs_events
+ *   terminate  terminating the root of a populated tree, pruning everything
+ *   consume    reading the changes and acknowledging them
+ *   emit       a full CHANGES response written by ChangesCommand
+ *   memory     bytes allocated per change tree node
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "../manager.hpp"
+#include "../unisonmanager.hpp"
+#include "shapes.hpp"
+
+namespace {
+  // Every allocation made by the process, so the tree's footprint can be
+  // measured without relying on the allocator's own statistics
+  std::atomic<int64_t> allocated_bytes{0};
+
+  struct alignas(16) AllocationHeader {
+    size_t size;
+  };
+}
+
+void *operator new(size_t size) {
+  auto *header = static_cast<AllocationHeader *>(std::malloc(size + sizeof(AllocationHeader)));
+  if (!header) {
+    throw std::bad_alloc();
+  }
+  header->size = size;
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  return header + 1;
+}
+
+void operator delete(void *p) noexcept {
+  if (p) {
+    auto *header = static_cast<AllocationHeader *>(p) - 1;
+    allocated_bytes.fetch_sub(header->size, std::memory_order_relaxed);
+    std::free(header);
+  }
+}
+
+void operator delete(void *p, size_t) noexcept {
+  operator delete(p);
+}
+
+using namespace fm::land;
+
+namespace {
+  using bench_clock = std::chrono::steady_clock;
+
+  const string hash = "bench";
+  const string root = "/tmp/unison-fsmonitor-bench";
+
+  struct Result {
+    string name;
+    string shape;
+    size_t items;
+    vector<double> ns;
+    // A metric that isn't a duration, named by extra_name
+    double extra;
+    string extra_name;
+  };
+
+  /*
+   * A Manager with one replica, and a UnisonManager subscribed to it writing
+   * to a string
+   */
+  struct Fixture {
+    Manager manager;
+    std::ostringstream out;
+    UnisonManager unison_manager;
+
+    Fixture() : unison_manager{manager, out} {
+      this->manager.subscribe(this->client(), hash);
+      this->manager.add_replica({hash, root});
+    }
+
+    Manager::client_t client() const {
+      return this->unison_manager.client();
+    }
+
+    void push(const vector<fsw::event> &events) {
+      for (size_t i = 0; i < events.size(); i += 256) {
+        auto end = std::min(events.size(), i + 256);
+        this->manager.push_fs_events(vector<fsw::event>(events.begin() + i, events.begin() + end));
+      }
+    }
+  };
+
+  vector<fsw::event> make_events(const vector<string> &paths) {
+    vector<fsw::event> events;
+    events.reserve(paths.size());
+    for (auto &p : paths) {
+      events.emplace_back(root + "/" + p, time(nullptr), vector<fsw_event_flag>{Updated});
+    }
+    return events;
+  }
+
+  /*
+   * Files below `dir`, relative to it, up to `limit` of them
+   */
+  vector<string> capture(const string &dir, size_t limit) {
+    vector<string> paths;
+    boost::system::error_code ec;
+    boost::filesystem::recursive_directory_iterator it{dir, ec}, end;
+
+    for (; it != end && paths.size() < limit; it.increment(ec)) {
+      if (ec) {
+        continue;
+      }
+      paths.push_back(it->path().lexically_relative(dir).string());
+    }
+
+    return paths;
+  }
+
+  double elapsed_ns(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+  }
+
+  double median(vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+  }
+
+  size_t count_changes(const Directory &dir, epoch_t since) {
+    if (dir.terminated_since(since)) {
+      return 1;
+    }
+
+    size_t count = 0;
+    dir.each_child([&count, since](const string &, const Directory &child) {
+      count += count_changes(child, since);
+    });
+    return count;
+  }
+
+  void run_shape(const string &shape, const vector<fsw::event> &events, size_t repeat, vector<Result> &results) {
+    Result insert{"insert", shape, events.size(), {}, 0, ""};
+    Result terminate{"terminate", shape, 0, {}, 0, ""};
+    Result consume{"consume", shape, 0, {}, 0, ""};
+    Result emit{"emit", shape, 0, {}, 0, "bytes_per_second"};
+    Result memory{"memory", shape, 0, {}, 0, "bytes_per_node"};
+    vector<double> emit_rates;
+
+    for (size_t i = 0; i < repeat; ++i) {
+      {
+        Fixture fixture;
+        int64_t before = allocated_bytes.load();
+
+        auto start = bench_clock::now();
+        fixture.push(events);
+        insert.ns.push_back(elapsed_ns(start));
+
+        size_t nodes = fixture.manager.node_counts()[hash];
+        memory.items = nodes;
+        memory.ns.push_back(static_cast<double>(allocated_bytes.load() - before) / nodes);
+
+        // Terminating the root prunes the whole tree below it
+        terminate.items = nodes;
+        auto *dir = fixture.manager.directory(hash);
+        start = bench_clock::now();
+        dir->terminate(dir->epoch() + 1);
+        terminate.ns.push_back(elapsed_ns(start));
+      }
+
+      {
+        Fixture fixture;
+        fixture.push(events);
+
+        auto start = bench_clock::now();
+        size_t count = 0;
+        epoch_t epoch = fixture.manager.read_changes(fixture.client(), hash, [&count](const Directory &dir, epoch_t since) {
+          count = count_changes(dir, since);
+        });
+        fixture.manager.acknowledge(fixture.client(), hash, epoch);
+        consume.ns.push_back(elapsed_ns(start));
+        consume.items = count;
+      }
+
+      {
+        Fixture fixture;
+        fixture.push(events);
+
+        auto start = bench_clock::now();
+        ChangesCommand(fixture.unison_manager).process({hash});
+        double ns = elapsed_ns(start);
+        emit.ns.push_back(ns);
+
+        string response = fixture.out.str();
+        emit.items = std::count(response.begin(), response.end(), '\n') - 1;
+        emit_rates.push_back(response.size() / (ns / 1e9));
+      }
+    }
+
+    emit.extra = median(emit_rates);
+    memory.extra = median(memory.ns);
+    memory.ns.assign(1, 0);
+
+    results.push_back(insert);
+    results.push_back(terminate);
+    results.push_back(consume);
+    results.push_back(emit);
+    results.push_back(memory);
+  }
+
+  void print_json(const vector<Result> &results) {
+    std::cout << "{\"benchmarks\":[";
+    bool first = true;
+    for (auto &r : results) {
+      double m = median(r.ns);
+      double best = *std::min_element(r.ns.begin(), r.ns.end());
+
+      std::cout << (first ? "" : ",") << "\n  {\"name\":" << json_string(r.name)
+                << ",\"shape\":" << json_string(r.shape)
+                << ",\"items\":" << r.items;
+      if (m > 0) {
+        std::cout << ",\"median_ns\":" << m
+                  << ",\"min_ns\":" << best
+                  << ",\"items_per_second\":" << (r.items ? r.items / (m / 1e9) : 0);
+      }
+      if (!r.extra_name.empty()) {
+        std::cout << "," << json_string(r.extra_name) << ":" << r.extra;
+      }
+      std::cout << "}";
+      first = false;
+    }
+    std::cout << "\n]}" << std::endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  vector<string> shapes;
+  vector<string> captures;
+  size_t events = 100000;
+  size_t repeat = 5;
+  unsigned long seed = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--shape") == 0 && i + 1 < argc) {
+      shapes.push_back(argv[++i]);
+    } else if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      captures.push_back(argv[++i]);
+    } else if (std::strcmp(argv[i], "--events") == 0 && i + 1 < argc) {
+      events = std::stoul(argv[++i]);
+    } else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = std::max(1ul, std::stoul(argv[++i]));
+    } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = std::stoul(argv[++i]);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--shape " << boost::join(bench::shape_names(), "|") << "]..."
+                << " [--capture DIR]... [--events N] [--repeat N] [--seed N]" << std::endl;
+      return 2;
+    }
+  }
+
+  if (shapes.empty() && captures.empty()) {
+    shapes = bench::shape_names();
+  }
+
+  vector<Result> results;
+  for (auto &shape : shapes) {
+    bench::rng_t rng{seed};
+    vector<string> paths;
+    if (!bench::shape_paths(shape, rng, events, paths)) {
+      std::cerr << "Unknown shape " << shape << std::endl;
+      return 1;
+    }
+    run_shape(shape, make_events(paths), repeat, results);
+  }
+
+  // Trees captured from disk, one event per file
+  for (auto &dir : captures) {
+    auto paths = capture(dir, events);
+    if (paths.empty()) {
+      std::cerr << "Nothing to capture in " << dir << std::endl;
+      return 1;
+    }
+    run_shape("disk:" + dir, make_events(paths), repeat, results);
+  }
+
+  print_json(results);
+  return 0;
+}
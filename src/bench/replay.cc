@@ -0,0 +1,459 @@
+/*
+ * Replays a Unison protocol session against UnisonManager through pipes and
+ * reports how fast it was handled.
+ *
+ * The transcript has one command per line, exactly as Unison would send it.
+ * Lines from a debug log (">>> Received "...") are accepted as well, so a
+ * recorded session can be replayed as is. Blank lines and lines starting with
+ * '#' are ignored. Filesystem activity is simulated with:
+ *
+ *   @events SHAPE COUNT [HASH]
+ *
+ * which pushes COUNT synthetic events shaped like SHAPE (node_modules, build,
+ * renames, deep or wide) into the replica HASH, or the last replica started.
+ * Without a transcript a synthetic session is generated.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <boost/iostreams/device/file_descriptor.hpp>
+#include <boost/iostreams/stream.hpp>
+
+#include "../manager.hpp"
+#include "../metrics.hpp"
+#include "../reactor.hpp"
+#include "../unisonmanager.hpp"
+#include "shapes.hpp"
+
+using namespace fm::land;
+
+namespace {
+  namespace io = boost::iostreams;
+  using bench_clock = std::chrono::steady_clock;
+
+  struct Step {
+    // Sent to the monitor as is, unless this step is a batch of events
+    string line;
+    string command;
+    string hash;
+    string root;
+    vector<fsw::event> events;
+  };
+
+  /*
+   * Everything the monitor writes, collected on its own thread so that
+   * notifications can arrive at any time
+   */
+  class Responses {
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::pair<string, bench_clock::time_point>> _lines;
+    bool _closed = false;
+
+  public:
+    void run(std::istream &in) {
+      string line;
+      while (std::getline(in, line)) {
+        auto now = bench_clock::now();
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        this->_lines.emplace_back(std::move(line), now);
+        this->_cv.notify_one();
+      }
+
+      std::lock_guard<std::mutex> guard{this->_mutex};
+      this->_closed = true;
+      this->_cv.notify_one();
+    }
+
+    bool next(string &line, bench_clock::time_point &at, std::chrono::milliseconds timeout) {
+      std::unique_lock<std::mutex> lock{this->_mutex};
+      if (!this->_cv.wait_for(lock, timeout, [this]() { return !this->_lines.empty() || this->_closed; })) {
+        return false;
+      }
+      if (this->_lines.empty()) {
+        return false;
+      }
+
+      line = std::move(this->_lines.front().first);
+      at = this->_lines.front().second;
+      this->_lines.pop_front();
+      return true;
+    }
+  };
+
+  struct Report {
+    map<string, Histogram> commands;
+    Histogram notify;
+    uint64_t command_count = 0;
+    uint64_t event_count = 0;
+    uint64_t changes_count = 0;
+    uint64_t changes_paths = 0;
+    uint64_t changes_bytes = 0;
+    bench_clock::duration changes_time{0};
+    bench_clock::duration ingest_time{0};
+    bench_clock::duration total_time{0};
+  };
+
+  const std::chrono::milliseconds response_timeout{10000};
+
+  string strip_log_line(const string &line) {
+    static const string received = ">>> Received \"";
+    auto start = line.find(received);
+    if (start != string::npos) {
+      start += received.size();
+      auto end = line.rfind('"');
+      return end > start ? line.substr(start, end - start) : "";
+    }
+
+    // Everything else we logged is not a command
+    if (line.find("<<< Sent") != string::npos || line.find(" DEBUG ") != string::npos) {
+      return "";
+    }
+
+    return line;
+  }
+
+  vector<fsw::event> make_events(const string &root, const vector<string> &paths) {
+    vector<fsw::event> events;
+    events.reserve(paths.size());
+    for (auto &p : paths) {
+      events.emplace_back(root + "/" + p, time(nullptr), vector<fsw_event_flag>{Updated});
+    }
+    return events;
+  }
+
+  bool parse(std::istream &in, bench::rng_t &rng, vector<Step> &steps) {
+    map<string, string> roots;
+    string last_hash;
+    string raw;
+
+    while (std::getline(in, raw)) {
+      string line = strip_log_line(raw);
+      boost::trim(line);
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+
+      vector<string> words;
+      boost::split(words, line, boost::is_any_of("\t "), boost::token_compress_on);
+
+      if (words[0] == "@events") {
+        if (words.size() < 3) {
+          std::cerr << "Expected @events SHAPE COUNT [HASH]: " << line << std::endl;
+          return false;
+        }
+
+        Step step;
+        step.command = words[0];
+        step.hash = words.size() > 3 ? words[3] : last_hash;
+        if (roots.find(step.hash) == roots.end()) {
+          std::cerr << "No replica started for " << line << std::endl;
+          return false;
+        }
+        step.root = roots[step.hash];
+
+        vector<string> paths;
+        if (!bench::shape_paths(words[1], rng, std::stoul(words[2]), paths)) {
+          std::cerr << "Unknown shape " << words[1] << std::endl;
+          return false;
+        }
+        step.events = make_events(step.root, paths);
+        steps.push_back(std::move(step));
+        continue;
+      }
+
+      Step step;
+      step.line = line;
+      step.command = words[0];
+      if (words.size() > 1) {
+        step.hash = words[1];
+      }
+      if (step.command == "START" && words.size() > 2) {
+        roots[step.hash] = urldecode(words[2]);
+        last_hash = step.hash;
+      }
+      steps.push_back(std::move(step));
+    }
+
+    return true;
+  }
+
+  string synthetic_session(const string &shape, size_t rounds, size_t events) {
+    std::stringstream session;
+    session << "START bench /tmp/unison-fsmonitor-bench\n";
+    for (int i = 0; i < 16; ++i) {
+      session << "DIR dir" << i << "\n";
+    }
+    session << "DONE\n";
+
+    for (size_t i = 0; i < rounds; ++i) {
+      session << "WAIT bench\n"
+              << "@events " << shape << " " << events << "\n"
+              << "CHANGES bench\n";
+    }
+
+    return session.str();
+  }
+
+  class Replay {
+    Manager &_manager;
+    Reactor &_reactor;
+    std::ostream &_to_monitor;
+    Responses &_responses;
+    Report &_report;
+    bool _waiting = false;
+
+    bool expect(const string &terminator, bench_clock::time_point &at, uint64_t *paths = nullptr, uint64_t *bytes = nullptr) {
+      string line;
+      while (this->_responses.next(line, at, response_timeout)) {
+        if (line.compare(0, terminator.size(), terminator) == 0) {
+          return true;
+        }
+        if (paths) {
+          ++*paths;
+          *bytes += line.size() + 1;
+        }
+      }
+
+      std::cerr << "Timed out waiting for " << terminator << std::endl;
+      return false;
+    }
+
+  public:
+    Replay(Manager &manager, Reactor &reactor, std::ostream &to_monitor, Responses &responses, Report &report)
+        : _manager{manager}, _reactor{reactor}, _to_monitor{to_monitor}, _responses{responses}, _report{report} {}
+
+    bool run(const Step &step) {
+      bench_clock::time_point at;
+
+      if (step.command == "@events") {
+        auto start = bench_clock::now();
+        // On the reactor, like the monitors' events
+        std::promise<void> pushed;
+        this->_reactor.post([this, &step, &pushed]() {
+          for (size_t i = 0; i < step.events.size(); i += 256) {
+            auto end = std::min(step.events.size(), i + 256);
+            this->_manager.push_fs_events(vector<fsw::event>(step.events.begin() + i, step.events.begin() + end));
+          }
+          pushed.set_value();
+        });
+        pushed.get_future().wait();
+        this->_report.ingest_time += bench_clock::now() - start;
+        this->_report.event_count += step.events.size();
+
+        if (this->_waiting) {
+          if (!this->expect("CHANGES", at)) {
+            return false;
+          }
+          this->_report.notify.record(at - start);
+          this->_waiting = false;
+        }
+        return true;
+      }
+
+      // A WAIT answered straight away
+      if (this->_waiting) {
+        string line;
+        this->_responses.next(line, at, std::chrono::milliseconds(0));
+        this->_waiting = false;
+      }
+
+      auto start = bench_clock::now();
+      this->_to_monitor << step.line << std::endl;
+      ++this->_report.command_count;
+
+      bool answered = true;
+      if (step.command == "START" || step.command == "DIR" || step.command == "LINK") {
+        answered = this->expect("OK", at);
+      } else if (step.command == "CHANGES") {
+        answered = this->expect("DONE", at, &this->_report.changes_paths, &this->_report.changes_bytes);
+        ++this->_report.changes_count;
+        this->_report.changes_time += at - start;
+      } else {
+        if (step.command == "WAIT") {
+          this->_waiting = true;
+        }
+        return true;
+      }
+
+      if (answered) {
+        this->_report.commands[step.command].record(at - start);
+      }
+      return answered;
+    }
+  };
+
+  double seconds(bench_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  }
+
+  long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+  }
+
+  void print_text(const Report &r) {
+    auto line = [](const string &name, const Histogram &h) {
+      std::cout << "  " << name << ": n=" << h.count()
+                << " p50=" << h.percentile(0.5) / 1000.0 << "us"
+                << " p99=" << h.percentile(0.99) / 1000.0 << "us"
+                << " p999=" << h.percentile(0.999) / 1000.0 << "us" << std::endl;
+    };
+
+    std::cout << "commands:  " << r.command_count << " in " << seconds(r.total_time) << "s ("
+              << r.command_count / seconds(r.total_time) << "/s)" << std::endl;
+    std::cout << "events:    " << r.event_count << " ingested at "
+              << (r.event_count ? r.event_count / seconds(r.ingest_time) : 0) << "/s" << std::endl;
+    std::cout << "changes:   " << r.changes_count << " responses, " << r.changes_paths << " paths, "
+              << r.changes_bytes << " bytes at "
+              << (r.changes_count ? r.changes_bytes / seconds(r.changes_time) / 1e6 : 0) << " MB/s" << std::endl;
+    std::cout << "peak rss:  " << peak_rss_kb() << " KB" << std::endl;
+    std::cout << "latency:" << std::endl;
+    line("notify", r.notify);
+    for (auto &kv : r.commands) {
+      line(kv.first, kv.second);
+    }
+  }
+
+  void print_json(const Report &r) {
+    std::cout << "{\"commands\":" << r.command_count
+              << ",\"seconds\":" << seconds(r.total_time)
+              << ",\"commands_per_second\":" << r.command_count / seconds(r.total_time)
+              << ",\"events\":" << r.event_count
+              << ",\"events_per_second\":" << (r.event_count ? r.event_count / seconds(r.ingest_time) : 0)
+              << ",\"changes_responses\":" << r.changes_count
+              << ",\"changes_paths\":" << r.changes_paths
+              << ",\"changes_bytes\":" << r.changes_bytes
+              << ",\"changes_bytes_per_second\":" << (r.changes_count ? r.changes_bytes / seconds(r.changes_time) : 0)
+              << ",\"peak_rss_kb\":" << peak_rss_kb()
+              << ",\"latency_ns\":{\"notify\":";
+    r.notify.write_json(std::cout);
+    for (auto &kv : r.commands) {
+      std::cout << "," << json_string(kv.first) << ":";
+      kv.second.write_json(std::cout);
+    }
+    std::cout << "}}" << std::endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  string transcript;
+  string shape = "node_modules";
+  size_t rounds = 100;
+  size_t events = 10000;
+  unsigned long seed = 1;
+  bool json = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--shape") == 0 && i + 1 < argc) {
+      shape = argv[++i];
+    } else if (std::strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      rounds = std::stoul(argv[++i]);
+    } else if (std::strcmp(argv[i], "--events") == 0 && i + 1 < argc) {
+      events = std::stoul(argv[++i]);
+    } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = std::stoul(argv[++i]);
+    } else if (std::strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (argv[i][0] != '-' && transcript.empty()) {
+      transcript = argv[i];
+    } else {
+      std::cerr << "usage: " << argv[0] << " [TRANSCRIPT] [--shape " << boost::join(bench::shape_names(), "|") << "]"
+                << " [--rounds N] [--events N] [--seed N] [--json]" << std::endl;
+      return 2;
+    }
+  }
+
+  bench::rng_t rng{seed};
+  vector<Step> steps;
+  if (transcript.empty()) {
+    std::stringstream session{synthetic_session(shape, rounds, events)};
+    if (!parse(session, rng, steps)) {
+      return 1;
+    }
+  } else {
+    std::ifstream in{transcript};
+    if (!in) {
+      std::cerr << "Could not open " << transcript << std::endl;
+      return 1;
+    }
+    if (!parse(in, rng, steps)) {
+      return 1;
+    }
+  }
+
+  int to_monitor[2];
+  int from_monitor[2];
+  if (pipe(to_monitor) < 0 || pipe(from_monitor) < 0) {
+    std::cerr << "Could not create pipes" << std::endl;
+    return 1;
+  }
+
+  io::stream<io::file_descriptor_sink> monitor_out{from_monitor[1], io::close_handle};
+  io::stream<io::file_descriptor_sink> bench_out{to_monitor[1], io::close_handle};
+  io::stream<io::file_descriptor_source> bench_in{from_monitor[0], io::close_handle};
+
+  // No FSWatchManager: the filesystem is simulated, nothing is watched.
+  // Commands and events are handled on the reactor's thread, as in
+  // unison-fsmonitor.
+  Manager manager;
+  Reactor reactor;
+  Responses responses;
+  Report report;
+
+  UnisonManager unison_manager{manager, monitor_out};
+  unison_manager.attach(reactor, to_monitor[0], [&reactor]() {
+    reactor.stop();
+  });
+  std::thread monitor([&]() { reactor.run(); });
+  std::thread reader([&]() { responses.run(bench_in); });
+
+  string version;
+  bench_clock::time_point at;
+  responses.next(version, at, response_timeout);
+
+  Replay replay{manager, reactor, bench_out, responses, report};
+  bool success = true;
+  auto start = bench_clock::now();
+  for (auto &step : steps) {
+    if (!replay.run(step)) {
+      success = false;
+      break;
+    }
+  }
+  report.total_time = bench_clock::now() - start;
+
+  bench_out.close();
+  monitor.join();
+  monitor_out.close();
+  close(to_monitor[0]);
+  reader.join();
+
+  if (json) {
+    print_json(report);
+  } else {
+    print_text(report);
+  }
+
+  return success ? 0 : 1;
+}
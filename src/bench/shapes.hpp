@@ -0,0 +1,137 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace fm {
+  namespace land {
+    namespace bench {
+      using rng_t = std::mt19937_64;
+
+      // Skewed towards small values, like package and directory popularity
+      size_t skewed(rng_t &rng, size_t n) {
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        double u = unit(rng);
+        return static_cast<size_t>(u * u * u * n) % n;
+      }
+
+      /*
+       * Files deep inside a JavaScript dependency tree:
+       * node_modules/a/node_modules/b/.../lib/file.js
+       */
+      vector<string> node_modules_paths(rng_t &rng, size_t count, size_t max_depth = 8, size_t packages = 400) {
+        vector<string> paths;
+        paths.reserve(count);
+        std::uniform_int_distribution<size_t> depth(1, max_depth);
+
+        for (size_t i = 0; i < count; ++i) {
+          string p;
+          size_t d = depth(rng);
+          for (size_t j = 0; j < d; ++j) {
+            p += "node_modules/pkg" + std::to_string(skewed(rng, packages)) + "/";
+          }
+          p += "lib/file" + std::to_string(skewed(rng, 64)) + ".js";
+          paths.push_back(std::move(p));
+        }
+
+        return paths;
+      }
+
+      /*
+       * Object files spread over a very wide build directory:
+       * build/objN/fileM.o
+       */
+      vector<string> build_dir_paths(rng_t &rng, size_t count, size_t dirs = 2000) {
+        vector<string> paths;
+        paths.reserve(count);
+        std::uniform_int_distribution<size_t> dir(0, dirs - 1);
+
+        for (size_t i = 0; i < count; ++i) {
+          paths.push_back("build/obj" + std::to_string(dir(rng)) + "/file" + std::to_string(i) + ".o");
+        }
+
+        return paths;
+      }
+
+      /*
+       * Editors and tools saving through a temporary file: every save is an
+       * event for the temporary name and one for the final name
+       */
+      vector<string> rename_storm_paths(rng_t &rng, size_t count, size_t dirs = 200) {
+        vector<string> paths;
+        paths.reserve(count);
+
+        for (size_t i = 0; paths.size() < count; ++i) {
+          string dir = "src/dir" + std::to_string(skewed(rng, dirs)) + "/";
+          string file = "file" + std::to_string(skewed(rng, 100));
+          paths.push_back(dir + "." + file + "." + std::to_string(i) + ".tmp");
+          if (paths.size() < count) {
+            paths.push_back(dir + file);
+          }
+        }
+
+        return paths;
+      }
+
+      /*
+       * A chain of `depth` directories with `count` files at the bottom
+       */
+      vector<string> deep_paths(size_t count, size_t depth = 64) {
+        string dir;
+        for (size_t i = 0; i < depth; ++i) {
+          dir += "d" + std::to_string(i) + "/";
+        }
+
+        vector<string> paths;
+        paths.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+          paths.push_back(dir + "file" + std::to_string(i));
+        }
+
+        return paths;
+      }
+
+      /*
+       * `count` sibling directories with one file each
+       */
+      vector<string> wide_paths(size_t count) {
+        vector<string> paths;
+        paths.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+          paths.push_back("d" + std::to_string(i) + "/file");
+        }
+
+        return paths;
+      }
+
+      const vector<string> &shape_names() {
+        static const vector<string> names{"node_modules", "build", "renames", "deep", "wide"};
+        return names;
+      }
+
+      /*
+       * Returns false for an unknown shape
+       */
+      bool shape_paths(const string &shape, rng_t &rng, size_t count, vector<string> &paths) {
+        if (shape == "node_modules") {
+          paths = node_modules_paths(rng, count);
+        } else if (shape == "build") {
+          paths = build_dir_paths(rng, count);
+        } else if (shape == "renames") {
+          paths = rename_storm_paths(rng, count);
+        } else if (shape == "deep") {
+          paths = deep_paths(count);
+        } else if (shape == "wide") {
+          paths = wide_paths(count);
+        } else {
+          return false;
+        }
+        return true;
+      }
+    }
+  }
+}
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+#include "manager.hpp"
+#include "reactor.hpp"
+#include "result.hpp"
+#include "socket.hpp"
+#include "unisonmanager.hpp"
+
+namespace fm {
+  namespace land {
+    /*
+     * The socket used when none is given on the command line, one per user
+     */
+    string default_socket_path() {
+      const char *tmpdir = std::getenv("TMPDIR");
+      string dir = (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+      if (dir.back() != '/') {
+        dir.push_back('/');
+      }
+
+      return dir + "unison-fsmonitor-" + std::to_string(getuid()) + ".sock";
+    }
+
+    /*
+     * The output of a client. It is written to the socket as far as the
+     * socket takes it without blocking, and the rest once the reactor sees
+     * it writable again, so that a client that stops reading only holds up
+     * itself.
+     */
+    class OutputQueue : public std::streambuf {
+      Reactor &_reactor;
+      int _fd;
+      string _pending;
+      // Already written from the front of _pending
+      size_t _written;
+      bool _writer;
+      bool _failed;
+
+      void write_pending() {
+        while (this->_written < this->_pending.size()) {
+          ssize_t n = ::write(this->_fd, this->_pending.data() + this->_written, this->_pending.size() - this->_written);
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!this->_writer) {
+              this->_writer = true;
+              this->_reactor.add_writer(this->_fd, [this]() {
+                this->write_pending();
+              });
+            }
+            return;
+          }
+          if (n < 0) {
+            LOG_DEBUG("Could not write to client: " + string(std::strerror(errno)));
+            this->_failed = true;
+            break;
+          }
+          this->_written += n;
+        }
+
+        this->_pending.clear();
+        this->_written = 0;
+        if (this->_writer) {
+          this->_writer = false;
+          this->_reactor.remove_writer(this->_fd);
+        }
+      }
+
+    protected:
+      int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+          this->_pending.push_back(traits_type::to_char_type(c));
+        }
+        return this->_failed ? traits_type::eof() : traits_type::not_eof(c);
+      }
+
+      std::streamsize xsputn(const char *s, std::streamsize n) override {
+        if (this->_failed) {
+          return 0;
+        }
+        this->_pending.append(s, n);
+        return n;
+      }
+
+      int sync() override {
+        if (!this->_writer && !this->_failed) {
+          this->write_pending();
+        }
+        return this->_failed ? -1 : 0;
+      }
+
+    public:
+      OutputQueue(Reactor &reactor, int fd) : _reactor{reactor}, _fd{fd}, _written{0}, _writer{false}, _failed{false} {}
+
+      ~OutputQueue() override {
+        if (this->_writer) {
+          this->_reactor.remove_writer(this->_fd);
+        }
+      }
+    };
+
+    /*
+     * Serves the Unison protocol to any number of clients connecting to a unix
+     * socket. Every client gets its own UnisonManager but they all share the
+     * same Manager, and therefore the same watches. Clients are served from
+     * the reactor.
+     */
+    class Daemon {
+      struct Session {
+        int fd;
+        OutputQueue queue;
+        std::ostream out;
+        UnisonManager unison_manager;
+
+        Session(Manager &manager, Reactor &reactor, int fd) : fd{fd}, queue{reactor, fd}, out{&queue}, unison_manager{manager, out} {}
+
+        ~Session() {
+          close(this->fd);
+        }
+      };
+
+      Manager &_manager;
+      Reactor &_reactor;
+      string _socket_path;
+      int _fd;
+      std::map<int, std::unique_ptr<Session>> _sessions;
+      // Waits for SIGTERM and SIGINT, until the daemon is destroyed
+      std::thread _signals;
+      std::atomic<bool> _stopping;
+
+      static sigset_t stop_signals() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        return set;
+      }
+
+      void accept_client() {
+        int fd = accept(this->_fd, nullptr, nullptr);
+        if (fd < 0) {
+          return;
+        }
+
+        LOG_DEBUG("Accepted client on " + this->_socket_path);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        auto &session = this->_sessions[fd];
+        session.reset(new Session{this->_manager, this->_reactor, fd});
+        session->unison_manager.attach(this->_reactor, fd, [this, fd]() {
+          // Not from within the session's own reader
+          this->_reactor.post([this, fd]() {
+            this->_sessions.erase(fd);
+          });
+        });
+      }
+
+    public:
+      Daemon(Manager &manager, Reactor &reactor, const string &socket_path) : _manager{manager}, _reactor{reactor}, _socket_path{socket_path}, _fd{-1}, _stopping{false} {}
+
+      /*
+       * Must be called before any other thread is started so that SIGTERM
+       * and SIGINT are only ever delivered to the daemon's thread waiting for
+       * them, which stops the reactor
+       */
+      static void block_signals() {
+        sigset_t set = stop_signals();
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+      }
+
+      result<void> listen() {
+        auto socket = listen_on_socket(this->_socket_path);
+        if (!socket) {
+          return err("Could not listen on " + this->_socket_path);
+        }
+
+        this->_fd = socket.unwrap();
+        return ok();
+      }
+
+      /*
+       * Start accepting clients, the reactor serves them once it runs
+       */
+      void run() {
+        // A client going away while we write to it must not take the daemon down
+        std::signal(SIGPIPE, SIG_IGN);
+
+        this->_reactor.add_reader(this->_fd, [this]() {
+          this->accept_client();
+        });
+
+        // Stopped through the reactor, so that the daemon shuts down as
+        // usual and removes its socket
+        this->_signals = std::thread([this]() {
+          sigset_t set = stop_signals();
+          int signal;
+          if (sigwait(&set, &signal) == 0 && !this->_stopping) {
+            LOG_INFO("Stopping on " + string(strsignal(signal)));
+            this->_reactor.post([this]() {
+              this->_reactor.stop();
+            });
+          }
+        });
+      }
+
+      ~Daemon() {
+        if (this->_signals.joinable()) {
+          this->_stopping = true;
+          pthread_kill(this->_signals.native_handle(), SIGTERM);
+          this->_signals.join();
+        }
+        this->_sessions.clear();
+
+        if (this->_fd >= 0) {
+          this->_reactor.remove_reader(this->_fd);
+          close(this->_fd);
+          unlink(this->_socket_path.c_str());
+        }
+      }
+    };
+
+    /*
+     * Connect stdin and stdout to a running daemon, so that Unison can talk to
+     * it as if it were a regular unison-fsmonitor process
+     */
+    result<void> run_shim(const string &socket_path) {
+      // The default socket is in a shared directory, anybody could have put
+      // one there
+      struct stat st;
+      if (lstat(socket_path.c_str(), &st) != 0) {
+        return err("No socket at " + socket_path);
+      }
+      if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        LOG_WARNING(socket_path + " isn't a socket owned by the current user, ignoring it");
+        return err(socket_path + " isn't a socket owned by the current user");
+      }
+
+      auto socket = connect_to_socket(socket_path);
+      if (!socket) {
+        return err("Could not connect to " + socket_path);
+      }
+      int fd = socket.unwrap();
+
+      std::thread([fd]() {
+        std::array<char, 4096> buf;
+        while (true) {
+          ssize_t n = read(STDIN_FILENO, buf.data(), buf.size());
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n <= 0 || !write_all(fd, buf.data(), n)) {
+            break;
+          }
+        }
+
+        // Unison went away, let the daemon see the end of the stream
+        shutdown(fd, SHUT_WR);
+      }).detach();
+
+      std::array<char, 4096> buf;
+      while (true) {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0 || !write_all(STDOUT_FILENO, buf.data(), n)) {
+          break;
+        }
+      }
+
+      close(fd);
+      return ok();
+    }
+  }
+}
@@ -1,8 +1,22 @@
 #pragma once
 
-#include <fstream>
-#include <iostream>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
 #include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
 #include "../config.h"
 
 #ifdef DEBUG
@@ -11,12 +25,302 @@
 #define D(x) {}
 #endif
 
+// Statements below this level are compiled out: 0 debug, 1 info, 2 warning,
+// 3 error. Everything else is filtered at runtime by the logger's level.
+#ifndef FM_LOG_LEVEL
+#define FM_LOG_LEVEL 0
+#endif
+
+#define FM_LOG(level, statement)                                                         \
+  do {                                                                                   \
+    if (static_cast<int>(level) >= FM_LOG_LEVEL && ::fm::land::logger().enabled(level)) { \
+      ::fm::land::logger().write(level, statement);                                      \
+    }                                                                                    \
+  } while (0)
+
+#define LOG_DEBUG(statement) FM_LOG(::fm::land::log_level::debug, statement)
+#define LOG_INFO(statement) FM_LOG(::fm::land::log_level::info, statement)
+#define LOG_WARNING(statement) FM_LOG(::fm::land::log_level::warning, statement)
+#define LOG_ERROR(statement) FM_LOG(::fm::land::log_level::error, statement)
+
 namespace fm {
   namespace land {
+    enum class log_level : int {
+      debug = 0,
+      info = 1,
+      warning = 2,
+      error = 3,
+      off = 4
+    };
+
+    /*
+     * Log statements are copied into a fixed size lock-free ring buffer
+     * (Vyukov's bounded MPMC queue) and written out by a background thread to
+     * a file that stays open, so logging never blocks the caller on I/O. When
+     * the buffer is full statements are dropped and counted rather than
+     * waiting for the writer.
+     */
+    class Logger {
+      static const size_t capacity = 4096;
+      static const size_t text_size = 232;
+
+      struct Slot {
+        std::atomic<size_t> sequence;
+        log_level level;
+        uint32_t length;
+        std::chrono::system_clock::time_point time;
+        char text[text_size];
+      };
+
+      std::array<Slot, capacity> _slots;
+      std::atomic<size_t> _enqueue_pos;
+      std::atomic<size_t> _dequeue_pos;
+      std::atomic<int> _level;
+      std::atomic<uint64_t> _dropped;
+
+      std::mutex _mutex;
+      std::condition_variable _wakeup;
+      std::atomic<bool> _sleeping;
+      std::atomic<bool> _stopping;
+      std::once_flag _started;
+      std::thread _thread;
+      std::string _path;
+      int _fd;
+
+      bool push(log_level level, const std::string &statement) {
+        size_t pos = this->_enqueue_pos.load(std::memory_order_relaxed);
+        Slot *slot;
+
+        while (true) {
+          slot = &this->_slots[pos & (capacity - 1)];
+          size_t sequence = slot->sequence.load(std::memory_order_acquire);
+          intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+          if (diff == 0) {
+            if (this->_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+              break;
+            }
+          } else if (diff < 0) {
+            return false;
+          } else {
+            pos = this->_enqueue_pos.load(std::memory_order_relaxed);
+          }
+        }
+
+        slot->level = level;
+        slot->time = std::chrono::system_clock::now();
+        slot->length = static_cast<uint32_t>(statement.size() < text_size ? statement.size() : text_size);
+        std::memcpy(slot->text, statement.data(), slot->length);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Only ever called from the writer thread
+      bool pop(Slot &out) {
+        size_t pos = this->_dequeue_pos.load(std::memory_order_relaxed);
+        Slot *slot = &this->_slots[pos & (capacity - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1) < 0) {
+          return false;
+        }
+
+        out.level = slot->level;
+        out.time = slot->time;
+        out.length = slot->length;
+        std::memcpy(out.text, slot->text, slot->length);
+
+        this->_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        slot->sequence.store(pos + capacity, std::memory_order_release);
+        return true;
+      }
+
+      static const char *level_name(log_level level) {
+        switch (level) {
+        case log_level::debug:
+          return "DEBUG";
+        case log_level::info:
+          return "INFO";
+        case log_level::warning:
+          return "WARNING";
+        case log_level::error:
+          return "ERROR";
+        default:
+          return "";
+        }
+      }
+
+      void format(std::string &buffer, const Slot &slot) {
+        auto since_epoch = slot.time.time_since_epoch();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(since_epoch - seconds);
+        time_t t = static_cast<time_t>(seconds.count());
+        struct tm tm;
+        localtime_r(&t, &tm);
+
+        char prefix[64];
+        size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(prefix + n, sizeof(prefix) - n, ".%06ld %s ", static_cast<long>(micros.count()), level_name(slot.level));
+
+        buffer += prefix;
+        buffer.append(slot.text, slot.length);
+        if (slot.length == text_size) {
+          buffer += "...";
+        }
+        buffer.push_back('\n');
+      }
+
+      void flush(std::string &buffer) {
+        if (buffer.empty()) {
+          return;
+        }
+
+        if (this->_fd < 0) {
+          this->_fd = open(this->_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+
+        size_t written = 0;
+        while (this->_fd >= 0 && written < buffer.size()) {
+          ssize_t n = ::write(this->_fd, buffer.data() + written, buffer.size() - written);
+          if (n < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            break;
+          }
+          written += n;
+        }
+
+        buffer.clear();
+      }
+
+      void run() {
+        // Signals are for the threads that asked for them
+        sigset_t set;
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        std::string buffer;
+        Slot slot;
+        uint64_t reported_drops = 0;
+
+        while (true) {
+          while (this->pop(slot)) {
+            this->format(buffer, slot);
+            if (buffer.size() > 64 * 1024) {
+              this->flush(buffer);
+            }
+          }
+
+          uint64_t dropped = this->_dropped.load(std::memory_order_relaxed);
+          if (dropped != reported_drops) {
+            buffer += "Dropped " + std::to_string(dropped - reported_drops) + " log statements\n";
+            reported_drops = dropped;
+          }
+          this->flush(buffer);
+
+          if (this->_stopping.load(std::memory_order_acquire)) {
+            if (!this->pop(slot)) {
+              break;
+            }
+            this->format(buffer, slot);
+            continue;
+          }
+
+          std::unique_lock<std::mutex> lock{this->_mutex};
+          this->_sleeping.store(true, std::memory_order_seq_cst);
+          // Producers only notify when they see us sleeping, the timeout
+          // covers a statement pushed right before we went to sleep
+          this->_wakeup.wait_for(lock, std::chrono::milliseconds(50));
+          this->_sleeping.store(false, std::memory_order_relaxed);
+        }
+      }
+
+    public:
+      Logger() : _enqueue_pos(0),
+                 _dequeue_pos(0),
+#ifdef DEBUG
+                 _level(static_cast<int>(log_level::debug)),
+#else
+                 _level(static_cast<int>(log_level::off)),
+#endif
+                 _dropped(0),
+                 _sleeping(false),
+                 _stopping(false),
+                 _path("unison-fsmonitor.log"),
+                 _fd(-1) {
+        for (size_t i = 0; i < capacity; ++i) {
+          this->_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+      }
+
+      ~Logger() {
+        if (this->_thread.joinable()) {
+          this->_stopping.store(true, std::memory_order_release);
+          this->_wakeup.notify_one();
+          this->_thread.join();
+        }
+
+        if (this->_fd >= 0) {
+          close(this->_fd);
+        }
+      }
+
+      /*
+       * Has to be called before anything is logged
+       */
+      void set_path(const std::string &path) {
+        this->_path = path;
+      }
+
+      void set_level(log_level level) {
+        this->_level.store(static_cast<int>(level), std::memory_order_relaxed);
+      }
+
+      bool enabled(log_level level) const {
+        return static_cast<int>(level) >= this->_level.load(std::memory_order_relaxed);
+      }
+
+      void write(log_level level, const std::string &statement) {
+        std::call_once(this->_started, [this]() {
+          this->_thread = std::thread([this]() { this->run(); });
+        });
+
+        if (!this->push(level, statement)) {
+          this->_dropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+
+        if (this->_sleeping.load(std::memory_order_seq_cst)) {
+          this->_wakeup.notify_one();
+        }
+      }
+    };
+
+    Logger &logger() {
+      static Logger instance;
+      return instance;
+    }
+
+    bool parse_log_level(const std::string &name, log_level &level) {
+      if (name == "debug") {
+        level = log_level::debug;
+      } else if (name == "info") {
+        level = log_level::info;
+      } else if (name == "warning") {
+        level = log_level::warning;
+      } else if (name == "error") {
+        level = log_level::error;
+      } else if (name == "off") {
+        level = log_level::off;
+      } else {
+        return false;
+      }
+      return true;
+    }
+
     void log(std::string statement) {
-      std::ofstream file;
-      file.open("unison-fsmonitor.log", std::ios::app);
-      file << statement << std::endl;
+      LOG_DEBUG(statement);
     }
   }
 }
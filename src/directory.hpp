@@ -1,23 +1,50 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
 #include <string>
 
+#include <boost/utility/string_view.hpp>
+
 using std::map;
 using std::string;
 using std::function;
 
 namespace fm {
   namespace land {
+    /*
+     * Changes are stamped with the epoch of the batch of events that produced
+     * them. Epochs start at 1, so a cursor at 0 has seen nothing.
+     */
+    using epoch_t = uint64_t;
+
     class Directory {
-      bool _is_terminated;
-      bool _has_changes;
-      map<string, Directory> _contents;
+      // Newest change anywhere in this subtree
+      epoch_t _epoch;
+      // When this directory itself was last marked as changed, 0 if never
+      epoch_t _terminated_epoch;
+      // std::less<> lets children be looked up without building a string
+      map<string, Directory, std::less<>> _contents;
+
+      bool within(size_t &budget) const {
+        if (budget == 0) {
+          return false;
+        }
+        --budget;
+
+        for (auto &kv : this->_contents) {
+          if (!kv.second.within(budget)) {
+            return false;
+          }
+        }
+        return true;
+      }
 
     public:
-      Directory() : _is_terminated(false), _has_changes(false), _contents() {}
+      Directory() : _epoch(0), _terminated_epoch(0), _contents() {}
 
       void each_child(const function<void(const string &, const Directory &)> &f) const {
         for (auto &kv : this->_contents) {
@@ -25,22 +52,94 @@ namespace fm {
         }
       }
 
-      bool has_changes() {
-        return this->_has_changes;
+      bool has_changes() const {
+        return this->_epoch != 0;
+      }
+
+      bool has_changes_since(epoch_t epoch) const {
+        return this->_epoch > epoch;
+      }
+
+      epoch_t epoch() const {
+        return this->_epoch;
+      }
+
+      Directory &child(boost::string_view path, epoch_t epoch) {
+        this->_epoch = std::max(this->_epoch, epoch);
+
+        auto found = this->_contents.lower_bound(path);
+        if (found == this->_contents.end() || found->first != path) {
+          found = this->_contents.emplace_hint(found, string(path), Directory());
+        }
+        return found->second;
+      }
+
+      size_t child_count() const {
+        return this->_contents.size();
       }
 
-      Directory &child(const string &path) {
-        auto &child = this->_contents[path];
-        this->_has_changes = true;
-        return child;
+      bool has_child(boost::string_view name) const {
+        return this->_contents.find(name) != this->_contents.end();
       }
 
-      void terminate() {
-        this->_has_changes = true;
-        this->_is_terminated = true;
+      void terminate(epoch_t epoch) {
+        this->_epoch = std::max(this->_epoch, epoch);
+        this->_terminated_epoch = this->_epoch;
+
+        // Anyone who hasn't seen this termination will rescan the whole
+        // directory, and anyone who has is past every change below it
+        this->_contents.clear();
       }
+
       bool terminated() const {
-        return this->_is_terminated;
+        return this->_terminated_epoch != 0;
+      }
+
+      bool terminated_since(epoch_t epoch) const {
+        return this->_terminated_epoch > epoch;
+      }
+
+      // Number of nodes in the subtree, including this one
+      size_t size() const {
+        size_t count = 1;
+        for (auto &kv : this->_contents) {
+          count += kv.second.size();
+        }
+        return count;
+      }
+
+      // Whether the subtree has more than `count` nodes, without walking more
+      // than that
+      bool larger_than(size_t count) const {
+        size_t budget = count;
+        return !this->within(budget);
+      }
+
+      /*
+       * Drop every change made at or before `epoch`, returns true when
+       * nothing is left
+       */
+      bool collect(epoch_t epoch) {
+        if (this->_epoch <= epoch) {
+          this->_epoch = 0;
+          this->_terminated_epoch = 0;
+          this->_contents.clear();
+          return true;
+        }
+
+        if (this->_terminated_epoch <= epoch) {
+          this->_terminated_epoch = 0;
+        }
+
+        for (auto it = this->_contents.begin(); it != this->_contents.end();) {
+          if (it->second.collect(epoch)) {
+            it = this->_contents.erase(it);
+          } else {
+            ++it;
+          }
+        }
+
+        return false;
       }
     };
   }
@@ -1,8 +1,14 @@
+#pragma once
+
 #include <libfswatch/c++/event.hpp>
 #include <libfswatch/c++/filter.hpp>
 #include <libfswatch/c++/monitor.hpp>
 
 #include "manager.hpp"
+#include "reactor.hpp"
+#include "watch.hpp"
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <memory>
 #include <sstream>
@@ -15,44 +21,173 @@ namespace fm {
 
     struct Context {
       Manager &manager;
-      const Replica &replica;
+      Reactor &reactor;
+      const string root;
+      // Every event seen by the monitor, for the latency policy
+      std::atomic<uint64_t> events;
 
-      Context(Manager &manager, const Replica &replica) : manager(manager), replica(replica) {}
+      Context(Manager &manager, Reactor &reactor, const string &root) : manager(manager), reactor(reactor), root(root), events(0) {}
     };
 
-    class FSWatch {
+    /*
+     * A libfswatch monitor running on its own thread
+     */
+    class MonitorThread {
       unique_ptr<fsw::monitor> _monitor;
-      Manager &_manager;
       std::thread _thread;
-      const Replica &_replica;
+      // Set once the thread is done with the monitor
+      std::atomic<bool> _finished;
+
+    public:
+      explicit MonitorThread(fsw::monitor *monitor) : _monitor{monitor}, _finished{false} {}
+
+      MonitorThread(const MonitorThread &) = delete;
+      MonitorThread &operator=(const MonitorThread &) = delete;
+
+      ~MonitorThread() {
+        this->stop();
+      }
+
+      fsw::monitor &monitor() {
+        return *this->_monitor;
+      }
+
+      bool started() const {
+        return this->_thread.joinable();
+      }
+
+      bool is_running() const {
+        return this->_monitor->is_running();
+      }
+
+      void start() {
+        if (!this->_thread.joinable()) {
+          this->_thread = std::thread([this]() {
+            this->_monitor->start();
+            this->_finished = true;
+          });
+        }
+      }
+
+      // Until the monitor is up, or has given up
+      void wait_running() {
+        while (!this->_monitor->is_running() && !this->_finished) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+
+      void stop() {
+        if (!this->_thread.joinable()) {
+          return;
+        }
+
+        // A stop before the monitor is running is ignored by libfswatch
+        this->wait_running();
+        this->_monitor->stop();
+        this->_thread.join();
+      }
+    };
+
+    class FSWatch : public Watch {
+      unique_ptr<MonitorThread> _monitor;
+      Manager &_manager;
+      Reactor &_reactor;
+      string _root;
+      // Otherwise only the root itself is watched, not what is below it
+      bool _recursive;
+      double _latency;
 
       Context *_context;
 
+      MonitorThread *create_monitor(double latency) {
+        fsw::monitor *monitor = fsw::monitor_factory::create_monitor(fsw_monitor_type::system_default_monitor_type,
+                                                                     {this->_root},
+                                                                     [](const std::vector<fsw::event> &events, void *context) {
+                                                                       Context *ctx = static_cast<Context *>(context);
+                                                                       ctx->events.fetch_add(events.size(), std::memory_order_relaxed);
+                                                                       // Recorded on the reactor, the context may be gone by then
+                                                                       Manager &manager = ctx->manager;
+                                                                       ctx->reactor.post([&manager, events]() {
+                                                                         manager.push_fs_events(events);
+                                                                       });
+                                                                     },
+                                                                     static_cast<void *>(this->_context));
+
+        // Don't watch .git and .hg folders
+        monitor->add_filter(this->create_filter(fsw_filter_type::filter_exclude, "\\.git"));
+        monitor->add_filter(this->create_filter(fsw_filter_type::filter_exclude, "\\.DS_Store"));
+        monitor->add_filter(this->create_filter(fsw_filter_type::filter_exclude, "\\.hg"));
+
+        // Individual files are only needed when they are reported
+        monitor->set_directory_only(this->_manager.file_precision() == 0);
+        monitor->set_recursive(this->_recursive);
+        monitor->set_latency(latency);
+        return new MonitorThread{monitor};
+      }
+
     public:
+      /*
+       * Whether the default backend picks up latency changes while running.
+       * FSEvents only reads it when the stream is created, the others read it
+       * on every iteration of their loop.
+       */
+      static bool live_latency() {
+#ifdef __APPLE__
+        return false;
+#else
+        return true;
+#endif
+      }
+
       FSWatch(FSWatch &&watch) : _monitor{std::move(watch._monitor)},
                                  _manager{watch._manager},
-                                 _thread{std::move(watch._thread)},
-                                 _replica{watch._replica},
+                                 _reactor{watch._reactor},
+                                 _root{std::move(watch._root)},
+                                 _recursive{watch._recursive},
+                                 _latency{watch._latency},
                                  _context{watch._context} {
         watch._context = nullptr;
       }
 
-      FSWatch(Manager &manager, const Replica &replica) : _monitor{}, _manager{manager}, _replica{replica} {
-        this->_context = new Context{this->_manager, this->_replica};
-        this->_monitor.reset(fsw::monitor_factory::create_monitor(fsw_monitor_type::system_default_monitor_type,
-                                                                  {replica.fspath},
-                                                                  [](const std::vector<fsw::event> &events, void *context) {
-                                                                    Context *ctx = static_cast<Context *>(context);
-                                                                    ctx->manager.push_fs_events(ctx->replica, events);
-                                                                  },
-                                                                  static_cast<void *>(this->_context)));
+      FSWatch(Manager &manager, Reactor &reactor, const string &root, double latency, bool recursive = true)
+          : _monitor{}, _manager{manager}, _reactor{reactor}, _root{root}, _recursive{recursive}, _latency{latency} {
+        this->_context = new Context{this->_manager, this->_reactor, this->_root};
+        this->_monitor.reset(this->create_monitor(latency));
+      }
+
+      const string &root() const override {
+        return this->_root;
+      }
 
-        // Don't watch .git and .hg folders
-        this->_monitor->add_filter(this->create_filter(fsw_filter_type::filter_exclude, "\\.git"));
-        this->_monitor->add_filter(this->create_filter(fsw_filter_type::filter_exclude, "\\.DS_Store"));
-        this->_monitor->add_filter(this->create_filter(fsw_filter_type::filter_exclude, "\\.hg"));
+      uint64_t event_count() const override {
+        return this->_context->events.load(std::memory_order_relaxed);
+      }
 
-        this->_monitor->set_directory_only(true);
+      double latency() const override {
+        return this->_latency;
+      }
+
+      void set_latency(double latency) override {
+        if (latency == this->_latency) {
+          return;
+        }
+        this->_latency = latency;
+
+        if (live_latency()) {
+          this->_monitor->monitor().set_latency(latency);
+          return;
+        }
+
+        // The stream has to be created again. The new one starts before the
+        // old one stops, so that no event falls in between: the ones both
+        // see are recorded twice, which changes nothing.
+        unique_ptr<MonitorThread> previous{this->create_monitor(latency)};
+        if (this->_monitor->started()) {
+          previous->start();
+          previous->wait_running();
+        }
+        this->_monitor.swap(previous);
+        LOG_DEBUG("Restarted the monitor of " + this->_root + " with a latency of " + std::to_string(latency) + "s");
       }
 
       fsw::monitor_filter create_filter(fsw_filter_type type, std::string text) {
@@ -64,38 +199,30 @@ namespace fm {
       }
 
       void process_events(const std::vector<fsw::event> &events) {
-        this->_manager.push_fs_events(this->_replica, events);
+        this->_manager.push_fs_events(events);
       }
 
-      bool is_running() const {
+      bool is_running() const override {
         return this->_monitor->is_running();
       }
 
-      void start() {
-        if (!this->_monitor->is_running()) {
-          this->_thread = std::thread([this]() {
-            this->_monitor->start();
-          });
-        }
+      void start() override {
+        this->_monitor->start();
       }
-      void stop() {
+
+      void stop() override {
         if (this->_monitor) {
-          if (this->_monitor->is_running()) {
-            this->_monitor->stop();
-          }
+          this->_monitor->stop();
         }
       }
 
-      ~FSWatch() {
+      ~FSWatch() override {
+        // The monitor's thread uses the context until it is joined
+        this->_monitor.reset();
+
         if (this->_context) {
           delete this->_context;
         }
-
-        if (this->_monitor) {
-          if (this->_monitor->is_running()) {
-            this->_monitor->stop();
-          }
-        }
       }
     };
   }
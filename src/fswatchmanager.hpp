@@ -1,13 +1,27 @@
 #pragma once
 
 #include "fswatch.hpp"
+#include "inotifywatch.hpp"
+#include "latencypolicy.hpp"
 #include "manager.hpp"
+#include "pollwatch.hpp"
+#include "reactor.hpp"
+#include "watch.hpp"
+#include <algorithm>
+#include <chrono>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using std::vector;
 using std::string;
 
@@ -15,45 +29,413 @@ namespace fm {
   namespace land {
     class FSWatchManager {
       Manager &_manager;
-      map<string, FSWatch> _watchers;
+      Reactor &_reactor;
+      // Watches are keyed by the directory they watch. Only the outermost
+      // directories any replica needs are watched, so that every replica
+      // (and every client) covering the same place shares one set of kernel
+      // watches, however the replicas are nested.
+      map<string, std::unique_ptr<Watch>> _watchers;
+      // The roots of the recursive watches by (st_dev, st_ino), to recognize
+      // them when they are reached through links or bind mounts. Only the
+      // roots: a directory within a watched tree reached through another
+      // path gets a watch of its own.
+      map<std::pair<dev_t, ino_t>, string> _watched_ids;
+      // The watches of only the directory of a followed link to a file, not
+      // the tree below it
+      std::set<string> _shallow;
+      std::mutex _watchers_mutex;
+
+      LatencyPolicy _policy;
+      PollMode _poll;
+      // Whether to use the native backend where there is one, rather than
+      // libfswatch
+      bool _native;
+      map<string, EventRate> _rates;
+      // The governor's timer on the reactor, 0 once stopped
+      size_t _governor;
+
+      struct Canary {
+        // When the canary was last created, while its event hasn't come yet
+        metrics_clock::time_point created;
+        bool pending;
+        // The directory isn't writable, or isn't watched in a way that can
+        // tell the canary apart
+        bool disabled;
+      };
+
+      // Seconds between canaries, 0 for none
+      double _canary_interval;
+      // By watched directory
+      map<string, Canary> _canaries;
+      size_t _canary_timer;
+
+      /*
+       * Adjust the latency of every monitor to whether Unison is waiting on
+       * one of its replicas and to how busy it is. Runs every second, and as
+       * soon as a WAIT comes in or is cancelled.
+       */
+      void govern() {
+        {
+          std::lock_guard<std::mutex> guard{this->_watchers_mutex};
+          for (auto &kv : this->_watchers) {
+            auto &watch = *kv.second;
+            double rate = this->_rates[kv.first].sample(watch.event_count());
+            watch.set_latency(this->_policy.latency(this->_manager.is_root_waited(kv.first), rate));
+          }
+        }
+
+        this->schedule_governor();
+      }
+
+      void schedule_governor() {
+        if (this->_governor) {
+          this->_reactor.cancel_timer(this->_governor);
+        }
+        this->_governor = this->_reactor.add_timer(std::chrono::seconds(1), [this]() {
+          this->_governor = 0;
+          this->govern();
+        });
+      }
+
+      string canary_path(const string &dir) const {
+        return (dir == "/" ? "" : dir) + "/" + canary_name + "-" + std::to_string(getpid());
+      }
+
+      /*
+       * Report every replica under `dir` as changed as a whole
+       */
+      void rescan(const string &dir) {
+        vector<string> roots;
+        this->_manager.each_replica([&dir, &roots](const Replica &replica) {
+          for (auto &root : replica.roots()) {
+            if (path_contains(dir, root.path)) {
+              roots.push_back(root.path);
+            }
+          }
+        });
+        this->_manager.push_dir_changes(roots);
+      }
+
+      /*
+       * Create and remove a canary in every replica root and followed
+       * directory link, after checking that the previous one came through.
+       * It only exists for an instant, so Unison doesn't find it in its
+       * scans.
+       */
+      void probe_canaries() {
+        vector<string> missing;
+        {
+          std::lock_guard<std::mutex> guard{this->_watchers_mutex};
+          auto now = metrics_clock::now();
+
+          for (auto it = this->_canaries.begin(); it != this->_canaries.end();) {
+            if (this->_watchers.count(it->first)) {
+              ++it;
+            } else {
+              it = this->_canaries.erase(it);
+            }
+          }
+
+          for (auto &kv : this->_watchers) {
+            auto &dir = kv.first;
+            auto &watch = *kv.second;
+            // The directory of a followed link to a file, which is in no
+            // replica and isn't ours to write to
+            if (this->_shallow.count(dir)) {
+              continue;
+            }
+            auto &canary = this->_canaries[dir];
+            if (canary.disabled || !watch.is_running()) {
+              continue;
+            }
+            // Polling only sees that the directory changed
+            if (dynamic_cast<PollWatch *>(&watch)) {
+              canary.disabled = true;
+              continue;
+            }
+
+            // The event may legitimately wait for the watch's latency
+            double timeout = std::max(this->_canary_interval, watch.latency() * 2 + 1);
+            if (canary.pending) {
+              if (now - canary.created < std::chrono::duration<double>(timeout)) {
+                continue;
+              }
+              LOG_WARNING("The canary in " + dir + " never came through, rescanning every replica there");
+              missing.push_back(dir);
+            }
+
+            string path = this->canary_path(dir);
+            canary.created = metrics_clock::now();
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0) {
+              LOG_DEBUG("Can't create a canary in " + dir + ", not probing it");
+              canary.pending = false;
+              canary.disabled = true;
+              continue;
+            }
+            close(fd);
+            unlink(path.c_str());
+            canary.pending = true;
+          }
+        }
+
+        // Change handlers may take other locks
+        for (auto &dir : missing) {
+          this->rescan(dir);
+        }
+
+        this->schedule_canaries();
+      }
+
+      void schedule_canaries() {
+        auto interval = std::chrono::duration<double>(this->_canary_interval);
+        this->_canary_timer = this->_reactor.add_timer(std::chrono::duration_cast<Reactor::clock::duration>(interval), [this]() {
+          this->_canary_timer = 0;
+          this->probe_canaries();
+        });
+      }
+
+      void canary_seen(const string &path) {
+        auto now = metrics_clock::now();
+        std::lock_guard<std::mutex> guard{this->_watchers_mutex};
+
+        size_t slash = path.rfind('/');
+        auto found = this->_canaries.find(slash == 0 ? "/" : path.substr(0, slash));
+        // Another process's canary
+        if (found == this->_canaries.end() || !found->second.pending || path != this->canary_path(found->first)) {
+          return;
+        }
+
+        found->second.pending = false;
+        metrics().canary.record(now - found->second.created);
+        LOG_DEBUG("Canary in " + found->first + " came through in " +
+                  std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - found->second.created).count()) + "ms");
+      }
 
       void start_watching(const Replica &replica) {
-        auto found = this->_watchers.find(replica.hash);
-        if (found == this->_watchers.end()) {
-          // We are not watching this replica yet
-          auto watch = FSWatch{this->_manager, replica};
-          auto result = this->_watchers.emplace(std::make_pair(replica.hash, std::move(watch)));
-          if (std::get<1>(result)) {
-            // We successfully added the replica to our map, let's start it up
-            auto &new_fswatch = std::get<0>(result)->second;
-            new_fswatch.start();
+        std::lock_guard<std::mutex> guard{this->_watchers_mutex};
+        for (auto &root : replica.roots()) {
+          this->watch(replica.hash, root);
+        }
+      }
+
+      /*
+       * Where `p` is seen by a watch reaching it through other paths, if any
+       * of its parents is the same directory as a watched one. Must be called
+       * with _watchers_mutex held.
+       */
+      string watched_path(const string &p) {
+        struct stat st;
+        string parent = p;
+        while (true) {
+          if (stat(parent.c_str(), &st) == 0) {
+            auto found = this->_watched_ids.find({st.st_dev, st.st_ino});
+            if (found != this->_watched_ids.end()) {
+              string rest = p.substr(parent == "/" ? 0 : parent.size());
+              return found->second == "/" ? (rest.empty() ? "/" : rest) : found->second + rest;
+            }
           }
+
+          if (parent == "/") {
+            return "";
+          }
+          auto slash = parent.rfind('/');
+          parent = slash == 0 ? "/" : parent.substr(0, slash);
         }
       }
 
-      void stop_watching(const std::string &hash) {
-        auto found = this->_watchers.find(hash);
+      /*
+       * Make sure `root` is covered by a watch. Must be called with
+       * _watchers_mutex held.
+       */
+      void watch(const string &hash, const Replica::Root &root) {
+        // A link to a file is watched through its directory, and only that
+        // directory: a link to /etc/hosts doesn't need all of /etc
+        string dir = root.path;
+        bool recursive = true;
+        struct stat st;
+        if (stat(dir.c_str(), &st) == 0 && !S_ISDIR(st.st_mode) && dir != "/") {
+          dir = dir.substr(0, std::max<size_t>(dir.rfind('/'), 1));
+          recursive = false;
+        }
+
+        for (auto &kv : this->_watchers) {
+          bool covered = this->_shallow.count(kv.first) ? !recursive && kv.first == dir : path_contains(kv.first, dir);
+          if (covered) {
+            return;
+          }
+        }
+
+        // The same directory is already watched under another path, its
+        // events have to reach the replica from there
+        string seen = this->watched_path(root.path);
+        if (!seen.empty()) {
+          if (this->_manager.add_route(seen, hash, root.prefix)) {
+            LOG_DEBUG("Watching " + root.path + " through " + seen);
+          }
+          return;
+        }
+
+        // Replaces a shallow watch of the same directory, if there is one
+        auto new_watch = this->make_watch(dir, recursive);
+        new_watch->start();
+        this->_watchers[dir] = std::move(new_watch);
+
+        if (!recursive) {
+          this->_shallow.insert(dir);
+          return;
+        }
+        this->_shallow.erase(dir);
+        if (stat(dir.c_str(), &st) == 0) {
+          this->_watched_ids.emplace(std::make_pair(st.st_dev, st.st_ino), dir);
+        }
+
+        // The new watch covers the ones below it. They are only stopped now
+        // so nothing is missed in between, events seen by both are recorded
+        // twice, which is harmless.
+        for (auto it = this->_watchers.begin(); it != this->_watchers.end();) {
+          if (it->first != dir && path_contains(dir, it->first)) {
+            this->forget_id(it->first);
+            this->_shallow.erase(it->first);
+            this->_rates.erase(it->first);
+            it = this->_watchers.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+
+      std::unique_ptr<Watch> make_watch(const string &dir, bool recursive) {
+        bool poll = this->_poll == PollMode::always ||
+                    (this->_poll == PollMode::automatic && is_remote_filesystem(dir));
+        if (poll) {
+          LOG_INFO("Polling " + dir);
+          return std::unique_ptr<Watch>(new PollWatch{this->_manager, this->_reactor, dir, this->_policy.idle, recursive});
+        }
+
+#ifdef __linux__
+        if (this->_native) {
+          std::unique_ptr<InotifyWatch> watch{new InotifyWatch{this->_manager, this->_reactor, dir, this->_policy.idle, recursive}};
+          if (watch->usable()) {
+            return watch;
+          }
+          LOG_WARNING("Could not set up inotify for " + dir + ", falling back to libfswatch");
+        }
+#endif
+
+        return std::unique_ptr<Watch>(new FSWatch{this->_manager, this->_reactor, dir, this->_policy.idle, recursive});
+      }
+
+      void forget_id(const string &dir) {
+        for (auto it = this->_watched_ids.begin(); it != this->_watched_ids.end();) {
+          if (it->second == dir) {
+            it = this->_watched_ids.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+
+      void stop_watching(const std::string &root) {
+        std::lock_guard<std::mutex> guard{this->_watchers_mutex};
+        auto found = this->_watchers.find(root);
         if (found != this->_watchers.end()) {
-          std::get<1>(*found).stop();
+          found->second->stop();
         }
       }
 
     public:
-      FSWatchManager(Manager &manager) : _manager(manager), _watchers() {
+      FSWatchManager(Manager &manager,
+                     Reactor &reactor,
+                     LatencyPolicy policy = LatencyPolicy(),
+                     PollMode poll = PollMode::automatic,
+                     bool native = true) : _manager(manager),
+                                           _reactor(reactor),
+                                           _watchers(),
+                                           _policy(policy),
+                                           _poll(poll),
+                                           _native(native),
+                                           _governor(0),
+                                           _canary_interval(0),
+                                           _canary_timer(0) {
         // Whenever the manager starts watching a new replica, start a new FSWatch instance
         this->_manager.on_watch([this](const Replica &replica) {
           this->start_watching(replica);
         });
 
         this->_manager.on_unwatch([this](const Replica &replica) {
-          this->stop_watching(replica.hash);
+          this->stop_watching(replica.fspath);
+        });
+
+        // Wait changes come from the reactor, while handling WAIT or
+        // notifying a client
+        this->_manager.on_wait_change([this]() {
+          if (this->_governor) {
+            this->_reactor.cancel_timer(this->_governor);
+            this->_governor = this->_reactor.add_timer(Reactor::clock::duration::zero(), [this]() {
+              this->_governor = 0;
+              this->govern();
+            });
+          }
+        });
+
+        this->_manager.on_canary([this](const string &path) {
+          this->canary_seen(path);
+        });
+
+        this->schedule_governor();
+      }
+
+      /*
+       * Every `interval` seconds, create a canary in every watched directory
+       * and measure how long its event takes to come through, into
+       * Metrics::canary. Directories whose canary is missing have all their
+       * replicas reported as changed, in case the watch missed other events
+       * too.
+       */
+      void start_canaries(double interval) {
+        this->_canary_interval = interval;
+        if (interval > 0 && !this->_canary_timer) {
+          this->schedule_canaries();
+        }
+      }
+
+      ~FSWatchManager() {
+        this->stop();
+      }
+
+      // Number of monitors watching some part of each replica
+      map<string, uint64_t> watch_counts() {
+        map<string, uint64_t> counts;
+        std::lock_guard<std::mutex> guard{this->_watchers_mutex};
+        this->_manager.each_replica([this, &counts](const Replica &replica) {
+          auto roots = replica.roots();
+          auto &count = counts[replica.hash];
+          for (auto &kv : this->_watchers) {
+            for (auto &root : roots) {
+              if (path_contains(kv.first, root.path) || path_contains(root.path, kv.first)) {
+                ++count;
+                break;
+              }
+            }
+          }
         });
+        return counts;
       }
 
       void stop() {
+        if (this->_governor) {
+          this->_reactor.cancel_timer(this->_governor);
+          this->_governor = 0;
+        }
+        if (this->_canary_timer) {
+          this->_reactor.cancel_timer(this->_canary_timer);
+          this->_canary_timer = 0;
+        }
+
+        std::lock_guard<std::mutex> guard{this->_watchers_mutex};
         for (auto &watcher : this->_watchers) {
-          auto &fswatcher = std::get<1>(watcher);
-          fswatcher.stop();
+          watcher.second->stop();
         }
       }
     };
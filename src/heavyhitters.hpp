@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace fm {
+  namespace land {
+    /*
+     * The most frequent keys of a stream, per window of a minute, in bounded
+     * memory. Counted with Space-Saving: there are `capacity` counters, and a
+     * key without one takes over the smallest, inheriting its count. Counts
+     * may then be overestimated by as much as that, but any key making up
+     * more than 1/capacity of the window is there.
+     */
+    class HeavyHitters {
+    public:
+      struct Entry {
+        std::string key;
+        uint64_t count;
+        // Per second over the window
+        double rate;
+        // Part of everything counted in the window
+        double share;
+      };
+
+    private:
+      struct Counter {
+        size_t hash;
+        std::string key;
+        uint64_t count;
+      };
+
+      static const size_t capacity = 32;
+      // In seconds
+      static const int64_t window = 60;
+
+      std::vector<Counter> _counters;
+      uint64_t _total;
+      int64_t _window_start;
+      // The hottest keys of the last complete window
+      std::vector<Entry> _last;
+
+      static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+      }
+
+      std::vector<Entry> entries(int64_t elapsed) const {
+        std::vector<Entry> entries;
+        for (auto &counter : this->_counters) {
+          entries.push_back({counter.key,
+                             counter.count,
+                             static_cast<double>(counter.count) / std::max<int64_t>(elapsed, 1),
+                             static_cast<double>(counter.count) / this->_total});
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+          return a.count > b.count;
+        });
+        return entries;
+      }
+
+      void rotate(int64_t now) {
+        int64_t elapsed = now - this->_window_start;
+        if (elapsed < window) {
+          return;
+        }
+
+        // Nothing was counted in the last full window
+        if (elapsed >= 2 * window) {
+          this->_last.clear();
+        } else {
+          this->_last = this->entries(elapsed);
+        }
+
+        this->_counters.clear();
+        this->_total = 0;
+        this->_window_start = now;
+      }
+
+    public:
+      HeavyHitters() : _total(0), _window_start(now()) {}
+
+      void add(const std::string &key, uint64_t weight) {
+        this->rotate(now());
+        this->_total += weight;
+
+        size_t hash = std::hash<std::string>()(key);
+        for (auto &counter : this->_counters) {
+          if (counter.hash == hash && counter.key == key) {
+            counter.count += weight;
+            return;
+          }
+        }
+
+        if (this->_counters.size() < capacity) {
+          this->_counters.push_back({hash, key, weight});
+          return;
+        }
+
+        auto &smallest = *std::min_element(this->_counters.begin(), this->_counters.end(), [](const Counter &a, const Counter &b) {
+          return a.count < b.count;
+        });
+        smallest.hash = hash;
+        smallest.key = key;
+        smallest.count += weight;
+      }
+
+      /*
+       * The `count` hottest keys of the last complete window, hottest first
+       */
+      std::vector<Entry> top(size_t count) {
+        this->rotate(now());
+        std::vector<Entry> top(this->_last.begin(), this->_last.begin() + std::min(count, this->_last.size()));
+        return top;
+      }
+
+      /*
+       * The hottest key of the window going on, if anything was counted
+       */
+      bool hottest(Entry &entry) const {
+        if (this->_counters.empty()) {
+          return false;
+        }
+        entry = this->entries(now() - this->_window_start)[0];
+        return true;
+      }
+    };
+  }
+}
@@ -0,0 +1,643 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libfswatch/c++/event.hpp>
+
+#include "debug.hpp"
+#include "manager.hpp"
+#include "reactor.hpp"
+#include "walker.hpp"
+#include "watch.hpp"
+#include "watchbudget.hpp"
+
+namespace fm {
+  namespace land {
+    /*
+     * Watches a tree with inotify directly. libfswatch registers its watches
+     * one directory at a time before reporting anything, which makes up most
+     * of the startup time on large trees; here every directory is registered
+     * by a Walker over getdents64, and start() only returns once the whole
+     * tree is watched, so that the OK to START means just that.
+     *
+     * Events are read on a thread of their own and batched for the watch's
+     * latency before being handed to the manager on the reactor, like the
+     * ones of FSWatch.
+     *
+     * Directories the kernel has no watch left for are polled instead, like
+     * PollWatch does, and reported as a whole when their mtime changes. See
+     * WatchBudget for how watches move between the directories of every
+     * InotifyWatch.
+     */
+    class InotifyWatch : public Watch, public WatchHolder {
+      using clock = std::chrono::steady_clock;
+
+      static const uint32_t dir_mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+      // Polled directories that don't change are polled less and less often,
+      // in milliseconds
+      static const uint32_t min_poll_interval = 1000;
+      static const uint32_t max_poll_interval = 30000;
+
+      struct WatchedDir {
+        string path;
+        // When it last had an event, in seconds since the epoch
+        int64_t active;
+        // Polled now, its events are still read until the kernel confirms
+        // the watch is gone
+        bool demoted;
+      };
+
+      struct PolledDir {
+        ino_t ino;
+        int64_t mtime;
+        int64_t ctime;
+        // Its subdirectories when it was last read, to tell the new ones
+        vector<string> subdirs;
+        uint32_t interval;
+        // In milliseconds since the watch was created
+        int64_t due;
+      };
+
+      Manager &_manager;
+      Reactor &_reactor;
+      string _root;
+      // Otherwise only the root itself is watched, not what is below it
+      bool _recursive;
+      std::atomic<double> _latency;
+      std::atomic<uint64_t> _events;
+      std::atomic<bool> _running;
+
+      int _fd;
+      // Written to by stop(), and when directories start being polled, to
+      // wake the reading thread up
+      int _wakeup[2];
+      std::atomic<bool> _stopping;
+      std::thread _thread;
+      clock::time_point _started;
+
+      // Held by start() and the reading thread while they use the tables
+      // below, and by other watches demoting directories of this one
+      std::recursive_mutex _mutex;
+      // Watch descriptor -> watched directory
+      std::unordered_map<int, WatchedDir> _dirs;
+      // The directories there was no watch left for, by path
+      std::unordered_map<string, PolledDir> _polled;
+      // Whether that was already logged
+      bool _exhausted;
+
+      static string join(const string &dir, const char *name) {
+        return dir == "/" ? string("/") + name : dir + "/" + name;
+      }
+
+      int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - this->_started).count();
+      }
+
+      static bool dir_state(const string &dir, PolledDir &state) {
+        struct stat st;
+        if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+          return false;
+        }
+        state.ino = st.st_ino;
+        state.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        state.ctime = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+        return true;
+      }
+
+      // The paths of the subdirectories, sorted
+      static vector<string> subdirs(const string &dir) {
+        vector<string> subdirs;
+        read_directory(dir, [&dir, &subdirs](const char *name, bool is_dir) {
+          if (is_dir && !is_excluded_name(name)) {
+            subdirs.push_back(join(dir, name));
+          }
+        });
+        std::sort(subdirs.begin(), subdirs.end());
+        return subdirs;
+      }
+
+      /*
+       * Poll `dir` from now on. Must be called with _mutex held.
+       */
+      void poll_dir(const string &dir) {
+        PolledDir polled{};
+        if (!dir_state(dir, polled)) {
+          return;
+        }
+        polled.subdirs = subdirs(dir);
+        polled.interval = min_poll_interval;
+        polled.due = this->now() + min_poll_interval;
+        this->_polled[dir] = std::move(polled);
+      }
+
+      /*
+       * Watch `dirs` and every directory below them, or poll the ones the
+       * kernel has no watch left for. Each directory is watched before it is
+       * read, so that an entry created in between is either listed or
+       * reported. Must be called with _mutex held.
+       */
+      void add_watches(vector<string> dirs) {
+        // Per worker, merged once the walk is over
+        vector<vector<std::pair<int, string>>> added(Walker<string>::count());
+        vector<vector<string>> exhausted(Walker<string>::count());
+
+        Walker<string>::run(std::move(dirs), [this, &added, &exhausted](const string &dir, auto &push, size_t worker) {
+          if (!this->_recursive && dir != this->_root) {
+            return;
+          }
+
+          int wd = inotify_add_watch(this->_fd, dir.c_str(), dir_mask);
+          if (wd >= 0) {
+            added[worker].emplace_back(wd, dir);
+          } else if (errno == ENOSPC) {
+            // Polled, but what is below may still get watches
+            exhausted[worker].push_back(dir);
+          } else {
+            return;
+          }
+
+          if (this->_recursive) {
+            read_directory(dir, [&dir, &push](const char *name, bool is_dir) {
+              if (is_dir && !is_excluded_name(name)) {
+                push(join(dir, name));
+              }
+            });
+          }
+        });
+
+        int64_t active = time(nullptr);
+        for (auto &results : added) {
+          for (auto &kv : results) {
+            this->_dirs[kv.first] = {std::move(kv.second), active, false};
+          }
+        }
+
+        vector<string> left;
+        for (auto &results : exhausted) {
+          std::move(results.begin(), results.end(), std::back_inserter(left));
+        }
+        if (left.empty()) {
+          return;
+        }
+
+        // Make room by polling idle directories instead
+        watch_budget().reclaim(left.size(), active);
+        size_t polled = 0;
+        for (auto &dir : left) {
+          int wd = inotify_add_watch(this->_fd, dir.c_str(), dir_mask);
+          if (wd >= 0) {
+            this->_dirs[wd] = {dir, active, false};
+          } else {
+            this->poll_dir(dir);
+            ++polled;
+          }
+        }
+
+        if (polled > 0 && !this->_exhausted) {
+          this->_exhausted = true;
+          LOG_WARNING("Out of inotify watches, polling " + std::to_string(polled) + " directories under " + this->_root +
+                      ". Raising fs.inotify.max_user_watches avoids this.");
+        } else if (polled > 0) {
+          LOG_DEBUG("Polling " + std::to_string(polled) + " more directories under " + this->_root);
+        }
+      }
+
+      /*
+       * Stop watching a directory that left the tree, and everything below
+       * it
+       */
+      void remove_watches(const string &dir) {
+        for (auto it = this->_dirs.begin(); it != this->_dirs.end();) {
+          if (path_contains(dir, it->second.path)) {
+            inotify_rm_watch(this->_fd, it->first);
+            it = this->_dirs.erase(it);
+          } else {
+            ++it;
+          }
+        }
+
+        for (auto it = this->_polled.begin(); it != this->_polled.end();) {
+          if (path_contains(dir, it->first)) {
+            it = this->_polled.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+
+      /*
+       * Stat the polled directories that are due. One that changed is
+       * reported as a whole, its new subdirectories are watched, and it gets
+       * a watch back if one can be had. Must be called with _mutex held.
+       */
+      void poll_dirs() {
+        int64_t now = this->now();
+        vector<std::pair<string, PolledDir>> changed;
+
+        for (auto it = this->_polled.begin(); it != this->_polled.end();) {
+          auto &polled = it->second;
+          if (polled.due > now) {
+            ++it;
+            continue;
+          }
+
+          PolledDir state{};
+          if (!dir_state(it->first, state)) {
+            // Gone, which its parent reports
+            it = this->_polled.erase(it);
+            continue;
+          }
+
+          if (state.ino == polled.ino && state.mtime == polled.mtime && state.ctime == polled.ctime) {
+            polled.interval *= 2;
+            if (polled.interval > max_poll_interval) {
+              polled.interval = max_poll_interval;
+            }
+            polled.due = now + polled.interval;
+          } else {
+            changed.emplace_back(it->first, std::move(state));
+          }
+          ++it;
+        }
+
+        if (changed.empty()) {
+          return;
+        }
+
+        int64_t active = time(nullptr);
+        bool reclaimed = false;
+        vector<string> created;
+        vector<string> dirs;
+
+        for (auto &kv : changed) {
+          auto &dir = kv.first;
+          auto &state = kv.second;
+          dirs.push_back(dir);
+
+          state.subdirs = subdirs(dir);
+          auto &old = this->_polled[dir].subdirs;
+          std::set_difference(state.subdirs.begin(), state.subdirs.end(), old.begin(), old.end(), std::back_inserter(created));
+
+          int wd = inotify_add_watch(this->_fd, dir.c_str(), dir_mask);
+          if (wd < 0 && errno == ENOSPC && !reclaimed) {
+            reclaimed = true;
+            watch_budget().reclaim(changed.size(), active);
+            wd = inotify_add_watch(this->_fd, dir.c_str(), dir_mask);
+          }
+
+          if (wd >= 0) {
+            this->_dirs[wd] = {dir, active, false};
+            this->_polled.erase(dir);
+          } else {
+            state.interval = min_poll_interval;
+            state.due = now + min_poll_interval;
+            this->_polled[dir] = std::move(state);
+          }
+        }
+
+        if (!created.empty()) {
+          this->add_watches(std::move(created));
+        }
+
+        this->_events.fetch_add(dirs.size(), std::memory_order_relaxed);
+        Manager &manager = this->_manager;
+        this->_reactor.post([&manager, dirs]() {
+          manager.push_dir_changes(dirs);
+        });
+      }
+
+      static vector<fsw_event_flag> flags(uint32_t mask) {
+        vector<fsw_event_flag> flags;
+        if (mask & IN_CREATE) {
+          flags.push_back(Created);
+        }
+        if (mask & (IN_DELETE | IN_DELETE_SELF)) {
+          flags.push_back(Removed);
+        }
+        if (mask & IN_MODIFY) {
+          flags.push_back(Updated);
+        }
+        if (mask & IN_ATTRIB) {
+          flags.push_back(AttributeModified);
+        }
+        if (mask & IN_MOVED_FROM) {
+          flags.push_back(MovedFrom);
+        }
+        if (mask & IN_MOVED_TO) {
+          flags.push_back(MovedTo);
+        }
+        if (mask & IN_ISDIR) {
+          flags.push_back(IsDir);
+        }
+        return flags;
+      }
+
+      /*
+       * Turn what was read into events, and watch the directories that came
+       * into the tree
+       */
+      void read_events(const char *buf, ssize_t size, vector<fsw::event> &batch) {
+        vector<string> created;
+        // Directories that moved, with where they were
+        vector<std::pair<int, string>> moved;
+        time_t now = time(nullptr);
+
+        for (ssize_t offset = 0; offset < size;) {
+          auto *e = reinterpret_cast<const struct inotify_event *>(buf + offset);
+          offset += sizeof(struct inotify_event) + e->len;
+
+          if (e->mask & IN_Q_OVERFLOW) {
+            // Anything could have changed
+            LOG_WARNING("inotify queue overflow under " + this->_root);
+            batch.emplace_back(this->_root, now, vector<fsw_event_flag>{Overflow});
+            continue;
+          }
+
+          auto found = this->_dirs.find(e->wd);
+          if (found == this->_dirs.end()) {
+            continue;
+          }
+
+          if (e->mask & IN_IGNORED) {
+            this->_dirs.erase(found);
+            continue;
+          }
+
+          if (e->mask & IN_MOVE_SELF) {
+            moved.emplace_back(e->wd, found->second.path);
+            continue;
+          }
+
+          if (e->len > 0 && is_excluded_name(e->name)) {
+            continue;
+          }
+
+          found->second.active = now;
+          string path = e->len > 0 ? join(found->second.path, e->name) : found->second.path;
+          if ((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO))) {
+            created.push_back(path);
+          }
+          batch.emplace_back(std::move(path), now, flags(e->mask));
+        }
+
+        if (!created.empty()) {
+          this->add_watches(std::move(created));
+        }
+
+        // A directory moved within the tree was watched again at its new
+        // path above, any other one left the tree
+        for (auto &kv : moved) {
+          auto found = this->_dirs.find(kv.first);
+          if (found != this->_dirs.end() && found->second.path == kv.second && kv.second != this->_root) {
+            this->remove_watches(kv.second);
+          }
+        }
+      }
+
+      void wake() {
+        char c = 0;
+        while (write(this->_wakeup[1], &c, 1) < 0 && errno == EINTR) {
+        }
+      }
+
+      void flush(vector<fsw::event> &batch) {
+        this->_events.fetch_add(batch.size(), std::memory_order_relaxed);
+        Manager &manager = this->_manager;
+        this->_reactor.post([&manager, batch]() {
+          manager.push_fs_events(batch);
+        });
+        batch.clear();
+      }
+
+      void run() {
+        alignas(struct inotify_event) char buf[65536];
+        vector<fsw::event> batch;
+        clock::time_point first;
+
+        while (true) {
+          // Wake up every second while directories are polled, and only for
+          // events otherwise
+          int timeout = -1;
+          {
+            std::lock_guard<std::recursive_mutex> guard{this->_mutex};
+            if (!this->_polled.empty()) {
+              timeout = min_poll_interval;
+            }
+          }
+          if (!batch.empty()) {
+            auto deadline = first + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(this->_latency.load()));
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count();
+            int until_flush = left < 0 ? 0 : static_cast<int>(left) + 1;
+            timeout = timeout < 0 ? until_flush : std::min(timeout, until_flush);
+          }
+
+          struct pollfd fds[2] = {{this->_fd, POLLIN, 0}, {this->_wakeup[0], POLLIN, 0}};
+          int n = ::poll(fds, 2, timeout);
+          if (n < 0 && errno != EINTR) {
+            break;
+          }
+          if (n > 0 && fds[1].revents) {
+            char drain[64];
+            while (read(this->_wakeup[0], drain, sizeof(drain)) > 0) {
+            }
+            if (this->_stopping) {
+              break;
+            }
+          }
+
+          if (n > 0 && (fds[0].revents & POLLIN)) {
+            ssize_t size = read(this->_fd, buf, sizeof(buf));
+            if (size > 0) {
+              if (batch.empty()) {
+                first = clock::now();
+              }
+              std::lock_guard<std::recursive_mutex> guard{this->_mutex};
+              this->read_events(buf, size, batch);
+            }
+          }
+
+          {
+            std::lock_guard<std::recursive_mutex> guard{this->_mutex};
+            if (!this->_polled.empty()) {
+              this->poll_dirs();
+            }
+          }
+
+          if (!batch.empty() && clock::now() - first >= std::chrono::duration<double>(this->_latency.load())) {
+            this->flush(batch);
+          }
+        }
+      }
+
+    public:
+      InotifyWatch(Manager &manager, Reactor &reactor, const string &root, double latency, bool recursive = true) : _manager{manager},
+                                                                                                                   _reactor{reactor},
+                                                                                                                   _root{root},
+                                                                                                                   _recursive{recursive},
+                                                                                                                   _latency{latency},
+                                                                                                                   _events{0},
+                                                                                                                   _running{false},
+                                                                                                                   _stopping{false},
+                                                                                                                   _started{clock::now()},
+                                                                                                                   _exhausted{false} {
+        this->_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (pipe(this->_wakeup) == 0) {
+          for (int fd : this->_wakeup) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+          }
+        } else {
+          this->_wakeup[0] = this->_wakeup[1] = -1;
+        }
+      }
+
+      InotifyWatch(const InotifyWatch &) = delete;
+      InotifyWatch &operator=(const InotifyWatch &) = delete;
+
+      /*
+       * Whether inotify could be set up, the process may be out of
+       * instances
+       */
+      bool usable() const {
+        return this->_fd >= 0 && this->_wakeup[0] >= 0;
+      }
+
+      const string &root() const override {
+        return this->_root;
+      }
+
+      uint64_t event_count() const override {
+        return this->_events.load(std::memory_order_relaxed);
+      }
+
+      double latency() const override {
+        return this->_latency.load();
+      }
+
+      void set_latency(double latency) override {
+        // Picked up by the reading thread with the next event
+        this->_latency = latency;
+      }
+
+      bool is_running() const override {
+        return this->_running.load();
+      }
+
+      void coldest(size_t count, int64_t idle_before, vector<Candidate> &candidates) override {
+        std::unique_lock<std::recursive_mutex> lock{this->_mutex, std::try_to_lock};
+        if (!lock.owns_lock()) {
+          return;
+        }
+
+        size_t begin = candidates.size();
+        for (auto &kv : this->_dirs) {
+          // The root stays watched, to notice it going away
+          if (kv.second.active < idle_before && !kv.second.demoted && kv.second.path != this->_root) {
+            candidates.push_back({kv.second.active, this, kv.first});
+          }
+        }
+
+        if (candidates.size() - begin > count) {
+          std::nth_element(candidates.begin() + begin, candidates.begin() + begin + count, candidates.end(), [](const Candidate &a, const Candidate &b) {
+            return a.active < b.active;
+          });
+          candidates.resize(begin + count);
+        }
+      }
+
+      size_t demote(const vector<int> &wds) override {
+        std::unique_lock<std::recursive_mutex> lock{this->_mutex, std::try_to_lock};
+        if (!lock.owns_lock()) {
+          return 0;
+        }
+
+        size_t demoted = 0;
+        for (int wd : wds) {
+          auto found = this->_dirs.find(wd);
+          if (found == this->_dirs.end() || found->second.demoted) {
+            continue;
+          }
+
+          // Polled before it is unwatched, and its last events are still
+          // read, so that nothing is missed in between
+          this->poll_dir(found->second.path);
+          inotify_rm_watch(this->_fd, wd);
+          found->second.demoted = true;
+          ++demoted;
+        }
+
+        if (demoted > 0) {
+          LOG_DEBUG("Polling " + std::to_string(demoted) + " idle directories under " + this->_root + " instead of watching them");
+          // The reading thread may be waiting for events only
+          this->wake();
+        }
+        return demoted;
+      }
+
+      void start() override {
+        if (!this->usable() || this->_running.exchange(true)) {
+          return;
+        }
+        watch_budget().add(this);
+
+        auto begin = clock::now();
+        {
+          std::lock_guard<std::recursive_mutex> guard{this->_mutex};
+          this->add_watches({this->_root});
+          LOG_DEBUG("Watching " + std::to_string(this->_dirs.size()) + " directories under " + this->_root + " in " +
+                    std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - begin).count()) + "ms");
+        }
+
+        this->_thread = std::thread([this]() {
+          this->run();
+        });
+      }
+
+      void stop() override {
+        if (this->_thread.joinable()) {
+          this->_stopping = true;
+          this->wake();
+          this->_thread.join();
+        }
+        this->_running = false;
+      }
+
+      ~InotifyWatch() override {
+        // Before anything goes, other watches may be demoting directories
+        // of this one
+        watch_budget().remove(this);
+        this->stop();
+
+        for (int fd : {this->_fd, this->_wakeup[0], this->_wakeup[1]}) {
+          if (fd >= 0) {
+            close(fd);
+          }
+        }
+      }
+    };
+  }
+}
+
+#endif
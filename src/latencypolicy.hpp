@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace fm {
+  namespace land {
+    /*
+     * Picks the batching window of a monitor. With nobody waiting for
+     * changes the monitor can batch for a long time and wake up rarely; once
+     * Unison is waiting it should report changes almost immediately, unless
+     * the replica is so busy that reporting right away would only trigger a
+     * sync in the middle of the storm.
+     */
+    struct LatencyPolicy {
+      // Seconds
+      double idle;
+      double waiting;
+      double storm;
+      // Events per second above which a waited replica counts as stormy
+      double storm_rate;
+
+      LatencyPolicy() : idle(2.0), waiting(0.05), storm(0.5), storm_rate(1000.0) {}
+
+      double latency(bool is_waiting, double rate) const {
+        if (!is_waiting) {
+          return this->idle;
+        }
+
+        return rate > this->storm_rate ? this->storm : this->waiting;
+      }
+    };
+
+    /*
+     * Exponentially weighted event rate, updated from periodic samples
+     */
+    class EventRate {
+      using clock = std::chrono::steady_clock;
+
+      double _rate;
+      // Rate over the last sampling period alone
+      double _current;
+      uint64_t _last_count;
+      clock::time_point _last_sample;
+
+    public:
+      EventRate() : _rate(0), _current(0), _last_count(0), _last_sample(clock::now()) {}
+
+      // `count` is the total number of events seen so far
+      double sample(uint64_t count) {
+        auto now = clock::now();
+        double elapsed = std::chrono::duration<double>(now - this->_last_sample).count();
+
+        if (elapsed > 0) {
+          this->_current = (count - this->_last_count) / elapsed;
+          this->_rate = this->_rate * 0.5 + this->_current * 0.5;
+        }
+
+        this->_last_count = count;
+        this->_last_sample = now;
+        return this->_rate;
+      }
+
+      double rate() const {
+        return this->_rate;
+      }
+
+      double current() const {
+        return this->_current;
+      }
+
+      // Seconds since the last sample
+      double age() const {
+        return std::chrono::duration<double>(clock::now() - this->_last_sample).count();
+      }
+    };
+  }
+}
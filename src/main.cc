@@ -1,16 +1,150 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include "daemon.hpp"
 #include "fswatchmanager.hpp"
 #include "manager.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
 #include "unisonmanager.hpp"
 
 int main(int argc, char **argv) {
   using namespace fm::land;
 
+  bool daemon = false;
+  bool shim = false;
+  string socket_path = default_socket_path();
+  string stats_file;
+  string stats_socket;
+  log_level level;
+  LatencyPolicy latency;
+  PollMode poll = PollMode::automatic;
+  size_t file_precision = 0;
+  bool hold_scanned = false;
+  double degrade_rate = 10000;
+  bool native = true;
+  size_t stat_cache = 0;
+  double canary_interval = 0;
+
+  // A positive number of seconds
+  auto seconds = [](const char *arg, double &value) {
+    char *end;
+    double parsed = std::strtod(arg, &end);
+    if (*end != '\0' || !(parsed > 0)) {
+      return false;
+    }
+    value = parsed;
+    return true;
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--daemon") == 0) {
+      daemon = true;
+    } else if (std::strcmp(argv[i], "--connect") == 0) {
+      shim = true;
+    } else if (std::strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats_file = argv[++i];
+    } else if (std::strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+      stats_socket = argv[++i];
+    } else if (std::strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+      logger().set_path(argv[++i]);
+    } else if (std::strcmp(argv[i], "--log-level") == 0 && i + 1 < argc && parse_log_level(argv[i + 1], level)) {
+      logger().set_level(level);
+      ++i;
+    } else if (std::strcmp(argv[i], "--idle-latency") == 0 && i + 1 < argc && seconds(argv[i + 1], latency.idle)) {
+      ++i;
+    } else if (std::strcmp(argv[i], "--wait-latency") == 0 && i + 1 < argc && seconds(argv[i + 1], latency.waiting)) {
+      ++i;
+    } else if (std::strcmp(argv[i], "--storm-latency") == 0 && i + 1 < argc && seconds(argv[i + 1], latency.storm)) {
+      ++i;
+    } else if (std::strcmp(argv[i], "--poll") == 0 && i + 1 < argc && parse_poll_mode(argv[i + 1], poll)) {
+      ++i;
+    } else if (std::strcmp(argv[i], "--file-precision") == 0 && i + 1 < argc) {
+      file_precision = std::strtoul(argv[++i], nullptr, 10);
+    } else if (std::strcmp(argv[i], "--hold-scanned") == 0) {
+      hold_scanned = true;
+    } else if (std::strcmp(argv[i], "--degrade-rate") == 0 && i + 1 < argc) {
+      degrade_rate = std::strtod(argv[++i], nullptr);
+    } else if (std::strcmp(argv[i], "--monitor") == 0 && i + 1 < argc &&
+               (std::strcmp(argv[i + 1], "native") == 0 || std::strcmp(argv[i + 1], "fswatch") == 0)) {
+      native = std::strcmp(argv[++i], "native") == 0;
+    } else if (std::strcmp(argv[i], "--canary-interval") == 0 && i + 1 < argc && seconds(argv[i + 1], canary_interval)) {
+      ++i;
+    } else if (std::strcmp(argv[i], "--stat-cache") == 0 && i + 1 < argc) {
+      stat_cache = std::strtoul(argv[++i], nullptr, 10);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--daemon | --connect] [--socket PATH]"
+                << " [--stats FILE] [--stats-socket PATH]"
+                << " [--log FILE] [--log-level debug|info|warning|error|off]"
+                << " [--idle-latency S] [--wait-latency S] [--storm-latency S]"
+                << " [--poll auto|always|never] [--file-precision N] [--hold-scanned]"
+                << " [--degrade-rate N] [--monitor native|fswatch]"
+                << " [--stat-cache N] [--canary-interval S]" << std::endl;
+      return 2;
+    }
+  }
+
+  if (shim) {
+    // Hand the session over to the daemon if there is one, otherwise serve it ourselves
+    if (run_shim(socket_path)) {
+      return 0;
+    }
+    LOG_DEBUG("No daemon listening on " + socket_path + ", running standalone");
+  }
+
+  // Has to happen before any thread is started
+  if (daemon) {
+    Daemon::block_signals();
+  }
+  if (!stats_file.empty()) {
+    metrics().enable();
+    dump_metrics_on_sigusr1(stats_file);
+  }
+
   Manager manager;
-  FSWatchManager fswatch_manager{manager};
-  UnisonManager unison_manager{manager};
+  manager.set_file_precision(file_precision);
+  manager.set_hold_scanned(hold_scanned);
+  manager.set_degrade_rate(degrade_rate);
+  manager.set_stat_cache(stat_cache);
+  Reactor reactor;
+  FSWatchManager fswatch_manager{manager, reactor, latency, poll, native};
+  fswatch_manager.start_canaries(canary_interval);
+
+  if (!stats_socket.empty()) {
+    metrics().enable();
+    if (!serve_metrics(stats_socket)) {
+      std::cerr << "Could not listen on " << stats_socket << std::endl;
+      return 1;
+    }
+  }
+
+  if (metrics().enabled()) {
+    metrics().add_gauge("nodes", [&manager]() { return manager.node_counts(); });
+    metrics().add_gauge("watches", [&fswatch_manager]() { return fswatch_manager.watch_counts(); });
+    metrics().add_gauge("hot_directory_events", [&manager]() { return manager.hot_directories(10, false); });
+    metrics().add_gauge("hot_directory_rates", [&manager]() { return manager.hot_directories(10, true); });
+  }
+
+  // Protocol input, events from the monitors and timers are all handled
+  // by the reactor on this thread
+  if (daemon) {
+    Daemon server{manager, reactor, socket_path};
+    if (!server.listen()) {
+      std::cerr << "Could not listen on " << socket_path << std::endl;
+      return 1;
+    }
+    server.run();
+    reactor.run();
+  } else {
+    UnisonManager unison_manager{manager};
 
-  unison_manager.start();
+    unison_manager.attach(reactor, STDIN_FILENO, [&reactor]() {
+      reactor.stop();
+    });
+    reactor.run();
+  }
 
   // When we quit, stop our watchers
   fswatch_manager.stop();
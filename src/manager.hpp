@@ -1,24 +1,37 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <set>
+#include <shared_mutex>
 #include <string>
 #include <tuple>
+#include <limits>
 #include <list>
 #include <vector>
 
 #include <boost/filesystem.hpp>
 #include <libfswatch/c++/event.hpp>
 
+#include "debug.hpp"
 #include "directory.hpp"
 #include "plf_colony.h"
 #include "group_by.hpp"
+#include "heavyhitters.hpp"
+#include "latencypolicy.hpp"
+#include "metrics.hpp"
+#include "pathsplit.hpp"
 #include "result.hpp"
+#include "roottrie.hpp"
+#include "statcache.hpp"
+#include "terminatedset.hpp"
 
 using std::queue;
 using std::map;
@@ -36,15 +49,29 @@ using boost::filesystem::path;
 namespace fm {
   namespace land {
     struct Replica {
+      /*
+       * A directory to watch for the replica, and where its contents are in
+       * the replica: empty for the replica's root, or a slash followed by
+       * their path relative to it
+       */
+      struct Root {
+        string path;
+        string prefix;
+      };
+
       string hash;
       string fspath;
       set<string> paths;
+      // Followed links, from their path in the replica (as a Root prefix) to
+      // the canonical path of their target
+      map<string, string> links;
 
       Replica() : hash(""), fspath(""), paths() {}
-      Replica(const Replica &replica) : hash(replica.hash), fspath(replica.fspath), paths(replica.paths) {}
-      Replica(Replica &&replica) noexcept : hash(std::move(replica.hash)), fspath(std::move(replica.fspath)), paths(std::move(replica.paths)) {}
+      Replica(const Replica &replica) : hash(replica.hash), fspath(replica.fspath), paths(replica.paths), links(replica.links) {}
+      Replica(Replica &&replica) noexcept : hash(std::move(replica.hash)), fspath(std::move(replica.fspath)), paths(std::move(replica.paths)), links(std::move(replica.links)) {}
       Replica(string hash, string fspath) : hash(hash), fspath(fspath) {}
       Replica(string hash, string fspath, set<string> paths) : hash(hash), fspath(fspath), paths(paths) {}
+      Replica(string hash, string fspath, set<string> paths, map<string, string> links) : hash(hash), fspath(fspath), paths(paths), links(links) {}
 
       ~Replica() {}
 
@@ -52,6 +79,7 @@ namespace fm {
         this->hash = replica.hash;
         this->fspath = replica.fspath;
         this->paths = replica.paths;
+        this->links = replica.links;
 
         return *this;
       }
@@ -60,51 +88,897 @@ namespace fm {
         this->paths.insert(path);
       }
 
-      void merge(const Replica &replica) {
+      /*
+       * Returns whether any path or link was new
+       */
+      bool merge(const Replica &replica) {
+        size_t size = this->paths.size() + this->links.size();
         if (this->hash == replica.hash) {
           for (auto &path : replica.paths) {
             this->paths.insert(path);
           }
+          for (auto &link : replica.links) {
+            this->links.insert(link);
+          }
+        }
+        return this->paths.size() + this->links.size() != size;
+      }
+
+      /*
+       * The directories that have to be watched: the parts of the replica
+       * Unison has started scanning, or the whole replica, and the targets of
+       * the links it follows
+       */
+      vector<Root> roots() const {
+        string root = normalize_path(this->fspath);
+        vector<Root> roots;
+        if (this->paths.empty() || this->paths.count("")) {
+          roots.push_back({root, ""});
+        } else {
+          for (auto &p : this->paths) {
+            string prefix = normalize_path("/" + p);
+            roots.push_back({normalize_path(root + prefix), prefix});
+          }
         }
+
+        for (auto &link : this->links) {
+          roots.push_back({link.second, link.first});
+        }
+        return roots;
+      }
+    };
+
+    // Files FSWatchManager creates to measure how long events take to come
+    // through, followed by a dash and its pid
+    constexpr char canary_name[] = ".unison-fsmonitor-canary";
+
+    /*
+     * Whether the normalized path is a canary, of this process or another
+     */
+    bool is_canary(string_view p) {
+      size_t slash = p.rfind('/');
+      return slash != string_view::npos && p.substr(slash + 1).starts_with(canary_name);
+    }
+
+    /*
+     * Whether the normalized path is one of the files Unison writes while
+     * propagating, or in one: temporary copies (.unison.NAME.SERIAL.unison.tmp)
+     * and backups with the default naming (.bak.VERSION.NAME)
+     */
+    bool is_unison_artifact(string_view p) {
+      // Both start a component with a dot, which few paths have, so only
+      // the dots are looked at
+      const char *end = p.data() + p.size();
+      for (const char *dot = p.data(); (dot = static_cast<const char *>(std::memchr(dot, '.', end - dot))); ++dot) {
+        if (dot == p.data() || dot[-1] != '/') {
+          continue;
+        }
+
+        string_view name(dot + 1, end - dot - 1);
+        if (name.starts_with("unison.")) {
+          // The temporary file itself, or a directory being propagated
+          // (.unison.conf is the user's own)
+          size_t slash = name.find('/');
+          string_view component = name.substr(0, slash);
+          if (component.size() >= 18 && component.ends_with(".unison.tmp")) {
+            return true;
+          }
+          continue;
+        }
+        if (name.starts_with("bak.")) {
+          size_t c = 4;
+          while (c < name.size() && name[c] >= '0' && name[c] <= '9') {
+            ++c;
+          }
+          if (c > 4 && c < name.size() && name[c] == '.') {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    struct ChangeSet;
+
+    /*
+     * Which replicas a client has unconsumed changes in, and which it is
+     * waiting on, as bitmasks over change set slots. Both are atomics so that
+     * WAIT and change notifications can intersect them without taking any
+     * change set's lock.
+     */
+    struct ClientState {
+      std::atomic<uint64_t> dirty;
+      std::atomic<uint64_t> waiting;
+
+      // Waited change sets sharing the overflow slot, they have to be checked
+      // one by one
+      mutex overflow_mutex;
+      vector<ChangeSet *> overflow_waiting;
+
+      ClientState() : dirty(0), waiting(0) {}
+    };
+
+    /*
+     * The changes recorded for one replica: its change tree, along with how
+     * far each subscribed client has consumed it. Every change set has its
+     * own lock, so that a busy replica doesn't hold up ingestion or
+     * consumption of the others.
+     */
+    struct ChangeSet {
+      using client_t = unsigned long;
+
+      // Subscribed change sets get a slot of their own in the clients'
+      // bitmasks, the last one is shared by any beyond that
+      static const size_t slots = 64;
+      static const size_t overflow_slot = slots - 1;
+      static const size_t no_slot = slots;
+
+      struct Cursor {
+        // Newest epoch the client has consumed
+        epoch_t epoch;
+        ClientState *client;
+      };
+
+      const string hash;
+      mutex lock;
+      Directory tree;
+      map<client_t, Cursor> cursors;
+      size_t slot;
+
+      // Events recorded so far and their rate, for Manager::set_degrade_rate.
+      // While storming the tree is reduced to its terminated root.
+      uint64_t events;
+      EventRate rate;
+      bool storming;
+
+      // The directories getting the most events, from one in
+      // Manager::hot_sample_rate of them
+      HeavyHitters hot;
+      size_t unsampled;
+
+      // Paths terminated in the tree since it was last read, see
+      // Manager::push_paths. Cleared whenever the tree is read or collected,
+      // or a client subscribes, as a later event there must then be
+      // recorded again.
+      TerminatedSet terminated;
+
+      ChangeSet(const string &hash) : hash(hash), slot(no_slot), events(0), storming(false), unsampled(0) {}
+
+      uint64_t bit() const {
+        return uint64_t(1) << this->slot;
+      }
+
+      /*
+       * Flag every subscribed client as having changes here. Must be called
+       * with the lock held.
+       */
+      void mark_dirty() {
+        for (auto &kv : this->cursors) {
+          kv.second.client->dirty.fetch_or(this->bit(), std::memory_order_release);
+        }
+      }
+
+      /*
+       * Clear the client's dirty flag if it has consumed everything. Must be
+       * called with the lock held.
+       */
+      void mark_clean(const Cursor &cursor) {
+        // Other change sets may have left the shared slot dirty
+        if (this->slot != overflow_slot && !this->tree.has_changes_since(cursor.epoch)) {
+          cursor.client->dirty.fetch_and(~this->bit(), std::memory_order_release);
+        }
+      }
+
+      /*
+       * Drop the changes every client has consumed. Must be called with the
+       * lock held.
+       */
+      void collect() {
+        this->terminated.clear();
+        if (this->cursors.empty()) {
+          this->tree = Directory();
+          return;
+        }
+
+        epoch_t oldest = std::min_element(this->cursors.begin(), this->cursors.end(), [](const std::pair<const client_t, Cursor> &a, const std::pair<const client_t, Cursor> &b) {
+          return a.second.epoch < b.second.epoch;
+        })->second.epoch;
+
+        this->tree.collect(oldest);
       }
     };
 
     class Manager {
+    public:
+      // Each connected Unison process is identified by a client id so that it
+      // can consume changes independently of every other client
+      using client_t = ChangeSet::client_t;
+
+    private:
       using watch_listener_t = function<void(const Replica &)>;
       using fs_change_listener_t = function<void(const string &)>;
 
-      mutex fs_changes_mutex;
       mutex watch_listeners_mutex;
+      mutex fs_change_listeners_mutex;
+      mutex replicas_mutex;
       plf::colony<Replica> _replicas;
       vector<watch_listener_t> _watch_listeners;
       vector<watch_listener_t> _off_watch_listeners;
-      map<string, Directory> _directory;
 
-      vector<fs_change_listener_t> _fs_change_listeners;
+      // One change set per replica hash, shared by every client. Change sets
+      // are never removed, so a pointer to one stays valid without holding
+      // this lock; only looking them up and adding them needs it.
+      std::shared_timed_mutex change_sets_mutex;
+      map<string, std::unique_ptr<ChangeSet>> _change_sets;
+      // Change set in each slot, and the free slots. Only changed with the
+      // change set that takes or releases the slot locked.
+      std::array<std::atomic<ChangeSet *>, ChangeSet::slots> _slots;
+      std::atomic<uint64_t> _free_slots;
+      std::atomic<epoch_t> _epoch;
+      std::atomic<client_t> _next_client;
+
+      mutex clients_mutex;
+      map<client_t, std::unique_ptr<ClientState>> _clients;
+
+      // Where events for a replica can come from: its root, the targets of
+      // the links it follows, and any other path these are watched through
+      struct Route {
+        string path;
+        string hash;
+        // Where the route's contents are in the replica, see Replica::Root
+        string prefix;
+      };
+
+      // Every route by its path, so an event is routed to all the replicas
+      // containing it in one lookup. Values index _route_list.
+      std::shared_timed_mutex routes_mutex;
+      RootTrie _routes;
+      vector<Route> _route_list;
+
+      // Events counted towards ChangeSet::hot, one in this many
+      static const size_t hot_sample_rate = 16;
+
+      // Changed files reported on their own in a directory before the whole
+      // directory is, 0 to always report directories
+      size_t _file_limit;
+
+      // Events per second above which a replica's changes are only tracked
+      // at its root, 0 to always track them precisely
+      double _degrade_rate;
+
+      // The metadata of recently changed files, to drop events that changed
+      // nothing, when set
+      std::unique_ptr<StatCache> _stat_cache;
+
+      // What each client is scanning between START and DONE: the replica's
+      // hash and the part of it (as a Replica::Root prefix). Events there
+      // are dropped when _hold_scanned is set.
+      bool _hold_scanned;
+      mutex scans_mutex;
+      map<client_t, std::pair<string, string>> _scans;
+      std::atomic<size_t> _scan_count;
+
+      map<size_t, fs_change_listener_t> _fs_change_listeners;
+      size_t _next_listener;
+
+      // Route path -> clients with a pending WAIT on a replica with a route
+      // there
+      mutex waits_mutex;
+      map<string, set<client_t>> _waits;
+      vector<function<void()>> _wait_change_listeners;
+      vector<function<void(const string &)>> _canary_listeners;
+
+      void trigger_wait_change() {
+        lock_guard<mutex> guard(this->watch_listeners_mutex);
+        for (auto &listener : this->_wait_change_listeners) {
+          listener();
+        }
+      }
+
+      ChangeSet *find_change_set(const string &hash) {
+        std::shared_lock<std::shared_timed_mutex> guard{this->change_sets_mutex};
+        auto found = this->_change_sets.find(hash);
+        return found == this->_change_sets.end() ? nullptr : found->second.get();
+      }
+
+      ChangeSet &change_set(const string &hash) {
+        auto *found = this->find_change_set(hash);
+        if (found) {
+          return *found;
+        }
+
+        std::unique_lock<std::shared_timed_mutex> guard{this->change_sets_mutex};
+        auto &slot = this->_change_sets[hash];
+        if (!slot) {
+          slot.reset(new ChangeSet(hash));
+        }
+        return *slot;
+      }
+
+      ClientState *client_state(client_t client) {
+        lock_guard<mutex> guard{this->clients_mutex};
+        auto found = this->_clients.find(client);
+        return found == this->_clients.end() ? nullptr : found->second.get();
+      }
+
+      /*
+       * Give a change set that gained its first subscriber a slot. Must be
+       * called with the change set locked.
+       */
+      void take_slot(ChangeSet &changes) {
+        uint64_t free = this->_free_slots.load();
+        while (true) {
+          // The overflow slot is never free
+          if (free == 0) {
+            changes.slot = ChangeSet::overflow_slot;
+            return;
+          }
+
+          size_t slot = __builtin_ctzll(free);
+          if (this->_free_slots.compare_exchange_weak(free, free & ~(uint64_t(1) << slot))) {
+            changes.slot = slot;
+            this->_slots[slot].store(&changes);
+            return;
+          }
+        }
+      }
+
+      /*
+       * Give back the slot of a change set that lost its last subscriber. Must
+       * be called with the change set locked.
+       */
+      void release_slot(ChangeSet &changes) {
+        if (changes.slot != ChangeSet::overflow_slot && changes.slot != ChangeSet::no_slot) {
+          this->_slots[changes.slot].store(nullptr);
+          this->_free_slots.fetch_or(changes.bit());
+        }
+        changes.slot = ChangeSet::no_slot;
+      }
+
+      /*
+       * Forget the client's cursor in the change set. Must be called with the
+       * change set locked.
+       */
+      void remove_cursor(ChangeSet &changes, client_t client) {
+        auto cursor = changes.cursors.find(client);
+        if (cursor == changes.cursors.end()) {
+          return;
+        }
+
+        if (changes.slot != ChangeSet::overflow_slot) {
+          cursor->second.client->dirty.fetch_and(~changes.bit());
+          cursor->second.client->waiting.fetch_and(~changes.bit());
+        }
+        changes.cursors.erase(cursor);
+        changes.collect();
+
+        if (changes.cursors.empty()) {
+          this->release_slot(changes);
+        }
+      }
+
+      /*
+       * Whether a change set sharing the overflow slot has changes the client
+       * waits for. Called with no change set locked.
+       */
+      bool overflow_changed(client_t client, ClientState &state, vector<string> *hashes) {
+        vector<ChangeSet *> waiting;
+        {
+          lock_guard<mutex> guard{state.overflow_mutex};
+          waiting = state.overflow_waiting;
+        }
+
+        bool changed = false;
+        for (auto *changes : waiting) {
+          lock_guard<mutex> guard{changes->lock};
+          auto cursor = changes->cursors.find(client);
+          if (cursor != changes->cursors.end() && changes->tree.has_changes_since(cursor->second.epoch)) {
+            changed = true;
+            if (hashes) {
+              hashes->push_back(changes->hash);
+            }
+          }
+        }
+        return changed;
+      }
+
+      /*
+       * Cancel the client's waits on individual roots
+       */
+      void clear_root_waits(client_t client) {
+        bool changed = false;
+        {
+          lock_guard<mutex> guard{this->waits_mutex};
+          for (auto it = this->_waits.begin(); it != this->_waits.end();) {
+            if (it->second.erase(client) && it->second.empty()) {
+              it = this->_waits.erase(it);
+              changed = true;
+            } else {
+              ++it;
+            }
+          }
+        }
+
+        if (changed) {
+          this->trigger_wait_change();
+        }
+      }
+
+      vector<ChangeSet *> all_change_sets() {
+        vector<ChangeSet *> change_sets;
+        std::shared_lock<std::shared_timed_mutex> guard{this->change_sets_mutex};
+        for (auto &kv : this->_change_sets) {
+          change_sets.push_back(kv.second.get());
+        }
+        return change_sets;
+      }
+
+      /*
+       * Terminate the entry the event is about, `rest` being its path
+       * relative to the replica's root: empty, or a slash followed by
+       * normalized components. A directory only gets `entries` of its entries
+       * terminated on their own, past that (and with 0) the directory is
+       * terminated as a whole.
+       *
+       * Returns the length of the part of `rest` that was terminated.
+       */
+      static size_t push_fs_event(Directory &tree, string_view rest, size_t entries, epoch_t epoch) {
+        Directory *dir = &tree;
+        size_t length = 0;
+
+        // An event for the root terminates the root
+        while (length < rest.size()) {
+          size_t slash = rest.find('/', length + 1);
+          if (slash == string_view::npos) {
+            auto name = rest.substr(length + 1);
+            if (dir->child_count() < entries || (entries > 0 && dir->has_child(name))) {
+              dir = &dir->child(name, epoch);
+              length = rest.size();
+            }
+            break;
+          }
+
+          dir = &dir->child(rest.substr(length + 1, slash - length - 1), epoch);
+          length = slash;
+        }
+
+        dir->terminate(epoch);
+        return length;
+      }
+
+      /*
+       * Whether the event push_fs_event would record for `rest` is already
+       * covered by a termination in `terminated`: its parent's, or its own
+       * when entries are terminated on their own
+       */
+      static bool is_terminated(TerminatedSet &terminated, string_view rest, size_t entries) {
+        if (entries == std::numeric_limits<size_t>::max() || rest.empty()) {
+          return terminated.contains(rest);
+        }
+
+        if (terminated.contains(rest.substr(0, rest.rfind('/')))) {
+          return true;
+        }
+        return entries > 0 && terminated.contains(rest);
+      }
+
+      /*
+       * Count `count` new events for the change set, and tell whether it is
+       * storming. The rate is sampled at most once a second. A storm starts
+       * when the smoothed rate goes over the threshold, and ends as soon as a
+       * period sees less than half of it, so that a rate hovering around the
+       * threshold doesn't flap while a storm that stops is noticed at once.
+       * Must be called with the change set's lock held.
+       */
+      bool storming(ChangeSet &changes, size_t count) {
+        if (this->_degrade_rate <= 0) {
+          return false;
+        }
+
+        changes.events += count;
+        if (changes.rate.age() >= 1.0) {
+          double rate = changes.rate.sample(changes.events);
+          if (!changes.storming && rate > this->_degrade_rate) {
+            changes.storming = true;
+            LOG_INFO("Replica " + changes.hash + " gets " + std::to_string(static_cast<uint64_t>(rate)) + " events/s, only tracking its root");
+
+            HeavyHitters::Entry hottest;
+            if (changes.hot.hottest(hottest) && hottest.share >= 0.5 && !hottest.key.empty()) {
+              LOG_INFO("Most of them are in ." + hottest.key + ", \"ignore = Path " + hottest.key.substr(1) +
+                       "\" in the Unison profile would leave it out");
+            }
+          } else if (changes.storming && changes.rate.current() < this->_degrade_rate / 2) {
+            changes.storming = false;
+            LOG_INFO("Replica " + changes.hash + " calmed down, tracking changes precisely again");
+          }
+        }
+
+        return changes.storming;
+      }
+
+      /*
+       * Count one in hot_sample_rate events towards the hottest directories
+       * of the replica: the one the event is in, or `relative` itself when
+       * it is a directory that changed as a whole. Must be called with the
+       * change set's lock held.
+       */
+      static void sample(ChangeSet &changes, string_view prefix, string_view relative, bool whole) {
+        if (++changes.unsampled < hot_sample_rate) {
+          return;
+        }
+        changes.unsampled = 0;
+
+        if (!whole) {
+          size_t slash = relative.rfind('/');
+          relative = relative.substr(0, slash == string_view::npos ? 0 : slash);
+        }
+
+        string dir(prefix.data(), prefix.size());
+        dir.append(relative.data(), relative.size());
+        changes.hot.add(dir, hot_sample_rate);
+      }
+
+      /*
+       * Whether `relative`, in the replica, is in a part of it being scanned
+       */
+      static bool is_scanned(const vector<std::pair<string, string>> &scans, const string &hash, string_view relative) {
+        for (auto &scan : scans) {
+          auto &prefix = scan.second;
+          if (scan.first == hash &&
+              relative.starts_with(prefix) &&
+              (relative.size() == prefix.size() || relative[prefix.size()] == '/')) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      /*
+       * Record the first `count` paths for every replica whose root contains
+       * them, `entries` being as for push_fs_event. The paths have to be
+       * normalized.
+       */
+      void push_paths(const vector<string> &paths, size_t count, size_t entries) {
+        bool whole = entries == std::numeric_limits<size_t>::max();
+        // route -> (path, where it starts relative to the route)
+        vector<vector<std::pair<size_t, size_t>>> routed;
+        vector<Route> routes;
+        {
+          std::shared_lock<std::shared_timed_mutex> guard{this->routes_mutex};
+          routed.resize(this->_route_list.size());
+
+          for (size_t i = 0; i < count; ++i) {
+            if (paths[i].empty() || paths[i][0] != '/') {
+              continue;
+            }
+
+            this->_routes.match(paths[i], [&routed, i](size_t route, size_t offset) {
+              routed[route].emplace_back(i, offset);
+            });
+          }
+
+          // Only the routes that got events
+          routes.resize(routed.size());
+          for (size_t route = 0; route < routed.size(); ++route) {
+            if (!routed[route].empty()) {
+              routes[route] = this->_route_list[route];
+            }
+          }
+        }
+
+        // Parts of replicas being scanned, when their events are held back
+        vector<std::pair<string, string>> scans;
+        if (this->_hold_scanned && this->_scan_count.load() > 0) {
+          lock_guard<mutex> guard{this->scans_mutex};
+          for (auto &kv : this->_scans) {
+            scans.push_back(kv.second);
+          }
+        }
+
+        vector<string> changed;
+        string rest;
+
+        for (size_t route = 0; route < routed.size(); ++route) {
+          if (routed[route].empty()) {
+            continue;
+          }
+
+          auto &hash = routes[route].hash;
+          auto &prefix = routes[route].prefix;
+          auto *changes = this->find_change_set(hash);
+          if (!changes) {
+            continue;
+          }
+
+          lock_guard<mutex> guard{changes->lock};
+          // Nobody is interested in this replica yet
+          if (changes->cursors.empty()) {
+            continue;
+          }
+
+          epoch_t epoch = ++this->_epoch;
+          size_t pushed = 0;
+          if (this->storming(*changes, routed[route].size())) {
+            // Unison will rescan the replica anyway, only count the events.
+            // The root has nothing below it by now, so this is cheap.
+            changes->tree.terminate(epoch);
+            pushed = routed[route].size();
+
+            for (auto &event : routed[route]) {
+              sample(*changes, prefix, string_view(paths[event.first]).substr(event.second), whole);
+            }
+          } else {
+            for (auto &event : routed[route]) {
+              auto relative = string_view(paths[event.first]).substr(event.second);
+              if (!prefix.empty()) {
+                // Seen through a link, or from a part of the replica
+                rest.assign(prefix);
+                rest.append(relative.data(), relative.size());
+                relative = rest;
+              }
+
+              if (!scans.empty() && is_scanned(scans, hash, relative)) {
+                continue;
+              }
+              sample(*changes, string_view(), relative, whole);
+              // The same directories tend to come up over and over until
+              // the tree is read, they only need walking down once
+              if (!is_terminated(changes->terminated, relative, entries)) {
+                changes->terminated.insert(relative.substr(0, push_fs_event(changes->tree, relative, entries, epoch)));
+              }
+              ++pushed;
+            }
+          }
+
+          if (pushed == 0) {
+            continue;
+          }
+          changes->mark_dirty();
+
+          metrics().event(hash);
+          if (std::find(changed.begin(), changed.end(), hash) == changed.end()) {
+            changed.push_back(hash);
+          }
+        }
+
+        // Change handlers are triggered without any change set locked so
+        // they can read the changes
+        for (auto &hash : changed) {
+          this->trigger_change(hash);
+        }
+      }
 
     public:
-      Manager() {}
+      Manager() : _free_slots(~(uint64_t(1) << ChangeSet::overflow_slot)), _epoch(0), _next_client(1), _file_limit(0), _degrade_rate(0), _hold_scanned(false), _scan_count(0), _next_listener(1) {
+        for (auto &slot : this->_slots) {
+          slot.store(nullptr);
+        }
+      }
+
+      /*
+       * Register a new client and return its id
+       */
+      client_t connect() {
+        client_t client = this->_next_client++;
+        lock_guard<mutex> guard{this->clients_mutex};
+        this->_clients.emplace(client, std::unique_ptr<ClientState>(new ClientState()));
+        return client;
+      }
 
       /*
-       * Add a replica to our collection
+       * Forget a client and every change it hasn't consumed yet
+       */
+      void disconnect(client_t client) {
+        this->clear_waits(client);
+        this->scan_done(client);
+
+        for (auto *changes : this->all_change_sets()) {
+          lock_guard<mutex> guard{changes->lock};
+          this->remove_cursor(*changes, client);
+        }
+
+        // No change set refers to the client's state anymore
+        lock_guard<mutex> guard{this->clients_mutex};
+        this->_clients.erase(client);
+      }
+
+      /*
+       * Start recording changes to the replica for the client. The client
+       * will only see changes made from now on.
+       */
+      void subscribe(client_t client, const string &hash) {
+        auto *state = this->client_state(client);
+        if (!state) {
+          return;
+        }
+
+        auto &changes = this->change_set(hash);
+        lock_guard<mutex> guard{changes.lock};
+        if (changes.cursors.empty()) {
+          this->take_slot(changes);
+        }
+        // Epochs are taken under the change set's lock, so every change
+        // recorded after this point is newer than the cursor
+        changes.cursors.emplace(client, ChangeSet::Cursor{this->_epoch.load(), state});
+        changes.terminated.clear();
+      }
+
+      /*
+       * Stop recording changes to the replica for the client, discarding any
+       * pending changes
+       */
+      void unsubscribe(client_t client, const string &hash) {
+        auto *changes = this->find_change_set(hash);
+        if (!changes) {
+          return;
+        }
+
+        lock_guard<mutex> guard{changes->lock};
+        this->remove_cursor(*changes, client);
+      }
+
+      /*
+       * Add a replica to our collection, or the paths of the replica to the
+       * one we have. The watch listeners are called whenever there is more
+       * to watch.
        */
       void add_replica(Replica replica) {
-        auto rep = std::find_if(this->_replicas.begin(), this->_replicas.end(), [&replica](const Replica &candidate_replica) {
-          return candidate_replica.hash == replica.hash;
-        });
+        Replica *new_replica = nullptr;
+
+        {
+          lock_guard<mutex> guard{this->replicas_mutex};
+          auto rep = std::find_if(this->_replicas.begin(), this->_replicas.end(), [&replica](const Replica &candidate_replica) {
+            return candidate_replica.hash == replica.hash;
+          });
+
+          if (rep == this->_replicas.end()) {
+            this->add_route(replica.fspath, replica.hash, "");
+            for (auto &link : replica.links) {
+              this->add_route(link.second, replica.hash, link.first);
+            }
 
-        if (rep == this->_replicas.end()) {
-          auto result = this->_replicas.insert(std::move(replica));
-          Replica &new_replica = *result;
+            auto result = this->_replicas.insert(std::move(replica));
+            new_replica = &*result;
+          } else if (rep->merge(replica)) {
+            // Unison started scanning another part of the replica, or
+            // followed a link
+            for (auto &link : replica.links) {
+              this->add_route(link.second, replica.hash, link.first);
+            }
+            new_replica = &*rep;
+          }
+        }
+
+        if (new_replica) {
           // Invoke the listeners
+          lock_guard<mutex> guard(this->watch_listeners_mutex);
           for (auto &listener : this->_watch_listeners) {
-            listener(new_replica);
+            listener(*new_replica);
           }
-        } else {
-          rep->merge(replica);
         }
       }
 
+      /*
+       * Record that events under `fspath` belong to the replica, at `prefix`
+       * in it (see Replica::Root). Returns whether the route is new.
+       */
+      bool add_route(const string &fspath, const string &hash, const string &prefix) {
+        string root = normalize_path(fspath);
+        vector<string_view> components;
+        if (!split_path(root, components)) {
+          return false;
+        }
+
+        std::unique_lock<std::shared_timed_mutex> guard{this->routes_mutex};
+        for (auto &route : this->_route_list) {
+          if (route.path == root && route.hash == hash && route.prefix == prefix) {
+            return false;
+          }
+        }
+
+        this->_routes.insert(components, this->_route_list.size());
+        this->_route_list.push_back({root, hash, prefix});
+        return true;
+      }
+
+      /*
+       * Follow the link at `link`, relative to the replica's root, so that
+       * changes to its target are reported under the link. Returns whether
+       * there was a link to follow.
+       */
+      bool add_link(const string &hash, const string &link) {
+        auto found = this->replica(hash);
+        if (!found.is_ok()) {
+          return false;
+        }
+
+        string root = normalize_path(found.unwrap().get().fspath);
+        string prefix = normalize_path("/" + link);
+        if (prefix == "/") {
+          return false;
+        }
+
+        boost::system::error_code ec;
+        string target = normalize_path(boost::filesystem::canonical(root + prefix, ec).string());
+        if (ec) {
+          LOG_WARNING("Can't resolve link " + root + prefix + ": " + ec.message());
+          return false;
+        }
+
+        // Unison can't follow such a link either, it would never get out
+        if (path_contains(target, root)) {
+          LOG_WARNING("Not following " + root + prefix + ", it points to a parent of the replica");
+          return false;
+        }
+
+        this->add_replica({hash, found.unwrap().get().fspath, {}, {{prefix, target}}});
+        return true;
+      }
+
+      /*
+       * Report changed files rather than their directory, up to `limit` of
+       * them per directory. Has to be set before any event comes in.
+       */
+      void set_file_precision(size_t limit) {
+        this->_file_limit = limit;
+      }
+
+      size_t file_precision() const {
+        return this->_file_limit;
+      }
+
+      /*
+       * Above `rate` events per second on a replica, report its root instead
+       * of building a tree Unison would mostly rescan anyway, until the rate
+       * falls again. 0 turns this off. Has to be set before any event comes
+       * in.
+       */
+      void set_degrade_rate(double rate) {
+        this->_degrade_rate = rate;
+      }
+
+      /*
+       * Stat every changed file and drop its event if its inode, size, mtime
+       * and ctime are the same as on its last event, remembering up to
+       * `entries` files. 0 turns this off. Has to be set before any event
+       * comes in.
+       */
+      void set_stat_cache(size_t entries) {
+        this->_stat_cache.reset(entries > 0 ? new StatCache(entries) : nullptr);
+      }
+
+      /*
+       * Drop events on the parts of replicas clients are scanning, between
+       * START and DONE. Unison is reading those parts right then, and its own
+       * writes around the scan don't trigger another sync. A change made to a
+       * directory Unison has already read is lost though, which is why this
+       * is optional. Has to be set before any event comes in.
+       */
+      void set_hold_scanned(bool hold) {
+        this->_hold_scanned = hold;
+      }
+
+      /*
+       * The client started scanning `path` (relative to the replica, empty for
+       * all of it) after a START
+       */
+      void scan_started(client_t client, const string &hash, const string &path) {
+        string prefix = path.empty() ? "" : normalize_path("/" + path);
+        if (prefix == "/") {
+          prefix = "";
+        }
+
+        lock_guard<mutex> guard{this->scans_mutex};
+        this->_scans[client] = std::make_pair(hash, prefix);
+        this->_scan_count = this->_scans.size();
+      }
+
+      void scan_done(client_t client) {
+        lock_guard<mutex> guard{this->scans_mutex};
+        this->_scans.erase(client);
+        this->_scan_count = this->_scans.size();
+      }
+
       void on_watch(watch_listener_t listener) {
         lock_guard<mutex> guard(this->watch_listeners_mutex);
         this->_watch_listeners.push_back(listener);
@@ -115,20 +989,183 @@ namespace fm {
         this->_off_watch_listeners.push_back(listener);
       }
 
-      void on_fs_change(fs_change_listener_t listener) {
+      size_t on_fs_change(fs_change_listener_t listener) {
+        lock_guard<mutex> guard(this->fs_change_listeners_mutex);
+        auto id = this->_next_listener++;
+        this->_fs_change_listeners.emplace(id, listener);
+        return id;
+      }
+
+      void off_fs_change(size_t id) {
+        lock_guard<mutex> guard(this->fs_change_listeners_mutex);
+        this->_fs_change_listeners.erase(id);
+      }
+
+      /*
+       * Called whenever the set of waited replicas changes, without any of
+       * the manager's locks held
+       */
+      void on_wait_change(function<void()> listener) {
+        lock_guard<mutex> guard(this->watch_listeners_mutex);
+        this->_wait_change_listeners.push_back(listener);
+      }
+
+      /*
+       * Called with the path of every canary event, which is otherwise
+       * dropped
+       */
+      void on_canary(function<void(const string &)> listener) {
         lock_guard<mutex> guard(this->watch_listeners_mutex);
-        this->_fs_change_listeners.push_back(listener);
+        this->_canary_listeners.push_back(listener);
+      }
+
+      /*
+       * Record that the client is waiting for changes to the replica. The
+       * client should then check for changes with take_changes, in case there
+       * were some already.
+       */
+      void wait(client_t client, const string &hash) {
+        auto found = this->replica(hash);
+        auto *state = this->client_state(client);
+        auto *changes = this->find_change_set(hash);
+        if (!found.is_ok() || !state || !changes) {
+          return;
+        }
+        // Every path events for the replica come from
+        vector<string> roots;
+        {
+          std::shared_lock<std::shared_timed_mutex> guard{this->routes_mutex};
+          for (auto &route : this->_route_list) {
+            if (route.hash == hash) {
+              roots.push_back(route.path);
+            }
+          }
+        }
+
+        {
+          lock_guard<mutex> guard{changes->lock};
+          if (!changes->cursors.count(client)) {
+            return;
+          }
+
+          if (changes->slot == ChangeSet::overflow_slot) {
+            lock_guard<mutex> overflow_guard{state->overflow_mutex};
+            state->overflow_waiting.push_back(changes);
+          }
+          state->waiting.fetch_or(changes->bit(), std::memory_order_acq_rel);
+        }
+
+        bool changed = false;
+        {
+          lock_guard<mutex> guard{this->waits_mutex};
+          for (auto &root : roots) {
+            auto &clients = this->_waits[root];
+            changed = changed || clients.empty();
+            clients.insert(client);
+          }
+        }
+
+        if (changed) {
+          this->trigger_wait_change();
+        }
+      }
+
+      /*
+       * Cancel every pending wait of the client
+       */
+      void clear_waits(client_t client) {
+        auto *state = this->client_state(client);
+        if (state) {
+          state->waiting.store(0, std::memory_order_release);
+          lock_guard<mutex> guard{state->overflow_mutex};
+          state->overflow_waiting.clear();
+        }
+
+        this->clear_root_waits(client);
+      }
+
+      /*
+       * If any replica the client waits on has changes, cancel all its waits
+       * and return those replicas. Only one caller gets them when several
+       * race, so the client is told once.
+       *
+       * When nothing changed this is a couple of atomic loads, no change set
+       * is locked.
+       */
+      vector<string> take_changes(client_t client) {
+        vector<string> hashes;
+        auto *state = this->client_state(client);
+        if (!state) {
+          return hashes;
+        }
+
+        uint64_t overflow = uint64_t(1) << ChangeSet::overflow_slot;
+        uint64_t waiting = state->waiting.load(std::memory_order_acquire);
+        uint64_t changed;
+
+        while (true) {
+          changed = waiting & state->dirty.load(std::memory_order_acquire);
+          if ((changed & overflow) && !this->overflow_changed(client, *state, nullptr)) {
+            changed &= ~overflow;
+          }
+
+          if (changed == 0) {
+            return hashes;
+          }
+
+          if (state->waiting.compare_exchange_weak(waiting, 0, std::memory_order_acq_rel)) {
+            break;
+          }
+        }
+
+        for (uint64_t bits = changed & ~overflow; bits; bits &= bits - 1) {
+          auto *changes = this->_slots[__builtin_ctzll(bits)].load();
+          if (changes) {
+            hashes.push_back(changes->hash);
+          }
+        }
+
+        if (changed & overflow) {
+          this->overflow_changed(client, *state, &hashes);
+          lock_guard<mutex> guard{state->overflow_mutex};
+          state->overflow_waiting.clear();
+        }
+
+        this->clear_root_waits(client);
+        return hashes;
+      }
+
+      /*
+       * Whether any client is waiting on a replica overlapping the directory
+       * `root`
+       */
+      bool is_root_waited(const string &root) {
+        lock_guard<mutex> guard{this->waits_mutex};
+        for (auto &kv : this->_waits) {
+          if (path_contains(kv.first, root) || path_contains(root, kv.first)) {
+            return true;
+          }
+        }
+        return false;
       }
 
       const plf::colony<Replica> &replicas() const {
         return this->_replicas;
       }
 
+      void each_replica(const function<void(const Replica &)> &f) {
+        lock_guard<mutex> guard{this->replicas_mutex};
+        for (const auto &replica : this->_replicas) {
+          f(replica);
+        }
+      }
+
       bool has_replica(const string &hash) {
         return this->replica(hash).is_ok();
       }
 
       result<std::reference_wrapper<const Replica>> replica(const string &hash) {
+        lock_guard<mutex> guard{this->replicas_mutex};
         for (const auto &replica : this->_replicas) {
           if (replica.hash == hash) {
             return ok(std::cref(replica));
@@ -138,67 +1175,177 @@ namespace fm {
         return err("No replica found with hash " + hash);
       }
 
-      void trigger_change(const Replica &replica) {
-        for (auto &listener : this->_fs_change_listeners) {
-          listener(replica.hash);
+      void trigger_change(const string &hash) {
+        // Listeners are invoked under the lock so that a listener can't be
+        // called after it has been removed
+        lock_guard<mutex> guard(this->fs_change_listeners_mutex);
+        for (auto &kv : this->_fs_change_listeners) {
+          kv.second(hash);
         }
       }
 
-      void push_fs_events(const Replica &replica, const vector<fsw::event> &events) {
-        // Ensure we release the guard before triggering change handlers so they can invoke
-        // methods that require a lock
-        {
-          lock_guard<mutex> guard{this->fs_changes_mutex};
-          path fspath(replica.fspath);
+      /*
+       * Whether the event may be about a file, rather than a directory or a
+       * queue overflow, which the stat cache can't judge: a directory's
+       * metadata doesn't change when a file in it is written to, and an
+       * overflow means anything could have changed
+       */
+      static bool is_file_event(const fsw::event &event) {
+        for (auto flag : event.get_flags()) {
+          if (flag == Overflow || flag == IsDir) {
+            return false;
+          }
+        }
+        return true;
+      }
 
-          for (auto &e : events) {
-            auto *dir = &this->_directory[replica.hash];
-            path p(e.get_path());
+      /*
+       * Record events for every replica whose root contains them, wherever
+       * they were watched from
+       */
+      void push_fs_events(const vector<fsw::event> &events) {
+        // The strings keep their capacity from one batch to the next, so
+        // copying the paths doesn't allocate
+        static thread_local vector<string> paths;
+        if (paths.size() < events.size()) {
+          paths.resize(events.size());
+        }
 
-            path rel = p.lexically_relative(fspath);
+        size_t count = 0;
+        for (auto &event : events) {
+          auto &p = paths[count];
+          p.assign(event.get_path());
+          if (!is_normalized(p)) {
+            p = normalize_path(p);
+          }
 
-            if (!rel.has_parent_path()) {
-              // The root has changed
-              dir->terminate();
-            } else {
-              path parent = rel.parent_path();
+          if (is_canary(p)) {
+            lock_guard<mutex> guard(this->watch_listeners_mutex);
+            for (auto &listener : this->_canary_listeners) {
+              listener(p);
+            }
+            continue;
+          }
 
-              for (auto &comp : parent) {
-                dir = &dir->child(comp.string());
-              }
+          // Unison's own writes would only make it sync again for nothing
+          if (is_unison_artifact(p)) {
+            continue;
+          }
+          if (this->_stat_cache && is_file_event(event) && this->_stat_cache->unchanged(p)) {
+            continue;
+          }
+          ++count;
+        }
 
-              dir->terminate();
-            }
+        this->push_paths(paths, count, this->_file_limit);
+      }
+
+      /*
+       * Record changes to the directories themselves rather than to one of
+       * their entries, for watches that only know a directory changed
+       */
+      void push_dir_changes(const vector<string> &dirs) {
+        static thread_local vector<string> paths;
+        if (paths.size() < dirs.size()) {
+          paths.resize(dirs.size());
+        }
+
+        for (size_t i = 0; i < dirs.size(); ++i) {
+          paths[i].assign(dirs[i]);
+          if (!is_normalized(paths[i])) {
+            paths[i] = normalize_path(paths[i]);
           }
         }
 
-        this->trigger_change(replica);
+        this->push_paths(paths, dirs.size(), std::numeric_limits<size_t>::max());
       }
 
-      Directory &directory(const string &hash) {
-        lock_guard<mutex> guard{this->fs_changes_mutex};
-        return this->_directory[hash];
+      /*
+       * The replica's change tree, if it has one
+       */
+      Directory *directory(const string &hash) {
+        auto *changes = this->find_change_set(hash);
+        return changes ? &changes->tree : nullptr;
       }
 
-      Directory consume_directory(const string &hash) {
-        lock_guard<mutex> guard{this->fs_changes_mutex};
+      /*
+       * Hand the replica's change tree to `reader`, along with the last epoch
+       * the client has consumed, so it can pick out the newer changes. The
+       * tree is only valid for the duration of the call.
+       *
+       * Returns the epoch the client should acknowledge once it has delivered
+       * those changes.
+       */
+      epoch_t read_changes(client_t client, const string &hash, const function<void(const Directory &, epoch_t)> &reader) {
+        auto *changes = this->find_change_set(hash);
+        if (!changes) {
+          return 0;
+        }
+
+        lock_guard<mutex> guard{changes->lock};
+        auto cursor = changes->cursors.find(client);
+        if (cursor == changes->cursors.end()) {
+          return 0;
+        }
+
+        reader(changes->tree, cursor->second.epoch);
+        changes->terminated.clear();
 
-        Directory d = this->_directory[hash];
-        this->_directory.erase(hash);
-        return d;
+        // Every change to this replica with a newer epoch is recorded after
+        // we release the lock
+        return this->_epoch.load();
       }
 
-      vector<string> changed_replicas(const vector<string> &interested_hashes) {
-        vector<string> changed_hashes;
-        lock_guard<mutex> guard{this->fs_changes_mutex};
+      /*
+       * Mark every change up to `epoch` as consumed by the client. Changes are
+       * only dropped once every client of the replica has consumed them.
+       */
+      void acknowledge(client_t client, const string &hash, epoch_t epoch) {
+        auto *changes = this->find_change_set(hash);
+        if (!changes) {
+          return;
+        }
+
+        lock_guard<mutex> guard{changes->lock};
+        auto cursor = changes->cursors.find(client);
+        if (cursor == changes->cursors.end() || cursor->second.epoch >= epoch) {
+          return;
+        }
+
+        cursor->second.epoch = epoch;
+        changes->collect();
+        changes->mark_clean(cursor->second);
+        metrics().consumed(hash);
+      }
 
-        for (auto &kv : this->_directory) {
-          if (kv.second.has_changes() && std::find(interested_hashes.begin(), interested_hashes.end(), kv.first) != interested_hashes.end()) {
-            changed_hashes.push_back(kv.first);
+      /*
+       * The `count` directories of every replica that got the most events
+       * over the last minute, as "HASH ./PATH", with their number of events,
+       * or their events per second if `rates` is set
+       */
+      map<string, uint64_t> hot_directories(size_t count, bool rates) {
+        map<string, uint64_t> hot;
+        std::shared_lock<std::shared_timed_mutex> guard{this->change_sets_mutex};
+        for (auto &kv : this->_change_sets) {
+          lock_guard<mutex> change_set_guard{kv.second->lock};
+          for (auto &entry : kv.second->hot.top(count)) {
+            hot[kv.first + " ." + entry.key] = rates ? static_cast<uint64_t>(entry.rate) : entry.count;
           }
         }
+        return hot;
+      }
 
-        return changed_hashes;
+      // Size of every replica's change tree
+      map<string, uint64_t> node_counts() {
+        map<string, uint64_t> counts;
+        std::shared_lock<std::shared_timed_mutex> guard{this->change_sets_mutex};
+        for (auto &kv : this->_change_sets) {
+          lock_guard<mutex> change_set_guard{kv.second->lock};
+          if (!kv.second->cursors.empty()) {
+            counts[kv.first] = kv.second->tree.size();
+          }
+        }
+        return counts;
       }
     };
   }
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "debug.hpp"
+#include "socket.hpp"
+
+using std::function;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace fm {
+  namespace land {
+    using metrics_clock = std::chrono::steady_clock;
+
+    /*
+     * A log-linear histogram in the spirit of HdrHistogram: every power of two
+     * is split into 16 linear buckets, which bounds the relative error to
+     * about 6% over the whole uint64_t range. Recording is a handful of
+     * relaxed atomic increments.
+     */
+    class Histogram {
+      static const int sub_bucket_bits = 4;
+      static const int sub_buckets = 1 << sub_bucket_bits;
+      static const int bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+      std::array<std::atomic<uint64_t>, bucket_count> _counts;
+      std::atomic<uint64_t> _count;
+      std::atomic<uint64_t> _sum;
+      std::atomic<uint64_t> _max;
+
+      static int msb(uint64_t value) {
+        return 63 - __builtin_clzll(value);
+      }
+
+      static int bucket(uint64_t value) {
+        if (value < sub_buckets) {
+          return static_cast<int>(value);
+        }
+
+        int shift = msb(value) - sub_bucket_bits;
+        return (shift + 1) * sub_buckets + static_cast<int>((value >> shift) & (sub_buckets - 1));
+      }
+
+      // The largest value that lands in the bucket
+      static uint64_t bucket_upper(int index) {
+        if (index < sub_buckets) {
+          return index;
+        }
+
+        int shift = index / sub_buckets - 1;
+        uint64_t lower = static_cast<uint64_t>(sub_buckets + index % sub_buckets) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+      }
+
+    public:
+      Histogram() : _count(0), _sum(0), _max(0) {
+        for (auto &count : this->_counts) {
+          count.store(0, std::memory_order_relaxed);
+        }
+      }
+
+      void record(uint64_t value) {
+        this->_counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        this->_count.fetch_add(1, std::memory_order_relaxed);
+        this->_sum.fetch_add(value, std::memory_order_relaxed);
+
+        uint64_t max = this->_max.load(std::memory_order_relaxed);
+        while (value > max && !this->_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+      }
+
+      void record(metrics_clock::duration duration) {
+        this->record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+      }
+
+      uint64_t count() const {
+        return this->_count.load(std::memory_order_relaxed);
+      }
+
+      /*
+       * The value below which `quantile` of the recorded values fall
+       */
+      uint64_t percentile(double quantile) const {
+        uint64_t total = this->count();
+        if (total == 0) {
+          return 0;
+        }
+
+        uint64_t target = static_cast<uint64_t>(quantile * total);
+        if (target >= total) {
+          target = total - 1;
+        }
+
+        uint64_t seen = 0;
+        for (int i = 0; i < bucket_count; ++i) {
+          seen += this->_counts[i].load(std::memory_order_relaxed);
+          if (seen > target) {
+            return std::min(bucket_upper(i), this->_max.load(std::memory_order_relaxed));
+          }
+        }
+
+        return this->_max.load(std::memory_order_relaxed);
+      }
+
+      void write_json(std::ostream &out) const {
+        uint64_t count = this->count();
+        out << "{\"count\":" << count
+            << ",\"mean\":" << (count ? this->_sum.load(std::memory_order_relaxed) / count : 0)
+            << ",\"max\":" << this->_max.load(std::memory_order_relaxed)
+            << ",\"p50\":" << this->percentile(0.5)
+            << ",\"p90\":" << this->percentile(0.9)
+            << ",\"p99\":" << this->percentile(0.99)
+            << ",\"p999\":" << this->percentile(0.999)
+            << ",\"buckets\":[";
+
+        // Only the non-empty buckets, as [upper bound, count] pairs
+        bool first = true;
+        for (int i = 0; i < bucket_count; ++i) {
+          uint64_t n = this->_counts[i].load(std::memory_order_relaxed);
+          if (n) {
+            out << (first ? "" : ",") << "[" << bucket_upper(i) << "," << n << "]";
+            first = false;
+          }
+        }
+
+        out << "]}";
+      }
+    };
+
+    string json_string(const string &s) {
+      string result = "\"";
+      for (char c : s) {
+        if (c == '"' || c == '\\') {
+          result.push_back('\\');
+          result.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          result += buf;
+        } else {
+          result.push_back(c);
+        }
+      }
+      result.push_back('"');
+      return result;
+    }
+
+    /*
+     * Process wide instrumentation. Everything is a no-op until `enable` is
+     * called, the hot paths only pay for a relaxed load of the flag.
+     */
+    class Metrics {
+    public:
+      // replica hash -> value
+      using gauge_t = function<map<string, uint64_t>()>;
+
+    private:
+      std::atomic<bool> _enabled;
+      std::mutex _mutex;
+      // When the oldest change nobody has been notified about arrived, per replica
+      map<string, metrics_clock::time_point> _pending;
+      vector<std::pair<string, gauge_t>> _gauges;
+
+    public:
+      // Time from an event batch reaching the Manager to the CHANGES
+      // notification being written
+      Histogram event_to_notify;
+      // Time spent collecting and writing a CHANGES response
+      Histogram changes_response;
+      // Time spent handling a command read from Unison
+      Histogram command;
+      // Time from creating a canary in a watched directory to its event
+      // reaching the Manager, see FSWatchManager::start_canaries
+      Histogram canary;
+
+      Metrics() : _enabled(false) {}
+
+      bool enabled() const {
+        return this->_enabled.load(std::memory_order_relaxed);
+      }
+
+      void enable() {
+        this->_enabled.store(true, std::memory_order_relaxed);
+      }
+
+      void add_gauge(const string &name, gauge_t gauge) {
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        this->_gauges.emplace_back(name, gauge);
+      }
+
+      void event(const string &hash) {
+        if (!this->enabled()) {
+          return;
+        }
+
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        this->_pending.emplace(hash, metrics_clock::now());
+      }
+
+      void notified(const string &hash) {
+        if (!this->enabled()) {
+          return;
+        }
+
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        auto found = this->_pending.find(hash);
+        if (found != this->_pending.end()) {
+          this->event_to_notify.record(metrics_clock::now() - found->second);
+          this->_pending.erase(found);
+        }
+      }
+
+      // The changes reached Unison without a notification
+      void consumed(const string &hash) {
+        if (!this->enabled()) {
+          return;
+        }
+
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        this->_pending.erase(hash);
+      }
+
+      void write_json(std::ostream &out) {
+        vector<std::pair<string, gauge_t>> gauges;
+        {
+          std::lock_guard<std::mutex> guard{this->_mutex};
+          gauges = this->_gauges;
+        }
+
+        out << "{\"histograms\":{\"event_to_notify_ns\":";
+        this->event_to_notify.write_json(out);
+        out << ",\"changes_response_ns\":";
+        this->changes_response.write_json(out);
+        out << ",\"command_ns\":";
+        this->command.write_json(out);
+        out << ",\"canary_ns\":";
+        this->canary.write_json(out);
+        out << "},\"gauges\":{";
+
+        bool first = true;
+        for (auto &gauge : gauges) {
+          out << (first ? "" : ",") << json_string(gauge.first) << ":{";
+          first = false;
+
+          bool first_value = true;
+          for (auto &kv : gauge.second()) {
+            out << (first_value ? "" : ",") << json_string(kv.first) << ":" << kv.second;
+            first_value = false;
+          }
+          out << "}";
+        }
+
+        out << "}}" << std::endl;
+      }
+
+      string json() {
+        std::stringstream out;
+        this->write_json(out);
+        return out.str();
+      }
+    };
+
+    Metrics &metrics() {
+      static Metrics instance;
+      return instance;
+    }
+
+    /*
+     * Records the lifetime of the timer into a histogram when metrics are
+     * enabled
+     */
+    class ScopedTimer {
+      Histogram *_histogram;
+      metrics_clock::time_point _start;
+
+    public:
+      ScopedTimer(Histogram &histogram) : _histogram{metrics().enabled() ? &histogram : nullptr} {
+        if (this->_histogram) {
+          this->_start = metrics_clock::now();
+        }
+      }
+
+      ~ScopedTimer() {
+        if (this->_histogram) {
+          this->_histogram->record(metrics_clock::now() - this->_start);
+        }
+      }
+    };
+
+    /*
+     * Must be called before any other thread is started so that SIGUSR1 is
+     * only ever delivered to the thread waiting for it
+     */
+    void dump_metrics_on_sigusr1(const string &file) {
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGUSR1);
+      pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+      std::thread([set, file]() {
+        int signal;
+        while (sigwait(&set, &signal) == 0) {
+          std::ofstream out{file, std::ios::trunc};
+          metrics().write_json(out);
+          LOG_DEBUG("Wrote metrics to " + file);
+        }
+      }).detach();
+    }
+
+    /*
+     * Write the metrics to every client connecting to the socket
+     */
+    result<void> serve_metrics(const string &socket_path) {
+      auto socket = listen_on_socket(socket_path);
+      if (!socket) {
+        return err("Could not listen on " + socket_path);
+      }
+      int fd = socket.unwrap();
+
+      // A client going away mid-write must not take the process down
+      std::signal(SIGPIPE, SIG_IGN);
+
+      std::thread([fd]() {
+        while (true) {
+          int client = accept(fd, nullptr, nullptr);
+          if (client < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            break;
+          }
+
+          string stats = metrics().json();
+          write_all(client, stats.data(), stats.size());
+          close(client);
+        }
+      }).detach();
+
+      return ok();
+    }
+  }
+}
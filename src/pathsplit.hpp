@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
+
+using std::string;
+using std::vector;
+
+namespace fm {
+  namespace land {
+    using boost::string_view;
+
+    namespace detail {
+      inline bool normalized_component(string_view comp) {
+        return !comp.empty() && comp != "." && comp != "..";
+      }
+    }
+
+    /*
+     * Append the components of an absolute path to `components` without
+     * allocating: they point into `p`. A single trailing slash is allowed.
+     * Only normalized paths are handled, anything with empty, "." or ".."
+     * components returns false and leaves `components` as it was.
+     */
+    bool split_path(string_view p, vector<string_view> &components) {
+      if (p.empty() || p[0] != '/') {
+        return false;
+      }
+
+      size_t size = components.size();
+      const char *c = p.data() + 1;
+      const char *end = p.data() + p.size();
+      if (end > c && end[-1] == '/') {
+        --end;
+      }
+
+      while (c < end) {
+        auto slash = static_cast<const char *>(std::memchr(c, '/', end - c));
+        string_view comp{c, static_cast<size_t>((slash ? slash : end) - c)};
+        if (!detail::normalized_component(comp)) {
+          components.resize(size);
+          return false;
+        }
+
+        components.push_back(comp);
+        if (!slash) {
+          break;
+        }
+        c = slash + 1;
+      }
+
+      return true;
+    }
+
+    /*
+     * Whether an absolute path has no empty, "." or ".." components and no
+     * trailing slash, so that it can be walked as is
+     */
+    bool is_normalized(string_view p) {
+      if (p.empty() || p[0] != '/') {
+        return false;
+      }
+      if (p.size() == 1) {
+        return true;
+      }
+
+      const char *c = p.data() + 1;
+      const char *end = p.data() + p.size();
+      while (true) {
+        auto slash = static_cast<const char *>(std::memchr(c, '/', end - c));
+        if (!detail::normalized_component(string_view{c, static_cast<size_t>((slash ? slash : end) - c)})) {
+          return false;
+        }
+        if (!slash) {
+          return true;
+        }
+        c = slash + 1;
+      }
+    }
+
+    /*
+     * The normalized form of an absolute path, without a trailing slash
+     * (except for "/" itself)
+     */
+    string normalize_path(const string &p) {
+      string normalized = boost::filesystem::path(p).lexically_normal().string();
+      while (normalized.size() > 1 && normalized.back() == '/') {
+        normalized.pop_back();
+      }
+      // lexically_normal leaves a trailing "." for "/a/b/."
+      if (normalized.size() > 2 && normalized.compare(normalized.size() - 2, 2, "/.") == 0) {
+        normalized.resize(normalized.size() - 2);
+      }
+      return normalized;
+    }
+
+    /*
+     * Whether the normalized path `inner` is `outer` or below it
+     */
+    bool path_contains(const string &outer, const string &inner) {
+      if (outer == "/") {
+        return !inner.empty() && inner[0] == '/';
+      }
+
+      return inner.size() >= outer.size() &&
+             inner.compare(0, outer.size(), outer) == 0 &&
+             (inner.size() == outer.size() || inner[outer.size()] == '/');
+    }
+  }
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+#include "manager.hpp"
+#include "reactor.hpp"
+#include "walker.hpp"
+#include "watch.hpp"
+
+namespace fm {
+  namespace land {
+    enum class PollMode {
+      // Poll the filesystems the kernel can't report remote changes on
+      automatic,
+      always,
+      never
+    };
+
+    bool parse_poll_mode(const char *name, PollMode &mode) {
+      if (std::strcmp(name, "auto") == 0) {
+        mode = PollMode::automatic;
+      } else if (std::strcmp(name, "always") == 0) {
+        mode = PollMode::always;
+      } else if (std::strcmp(name, "never") == 0) {
+        mode = PollMode::never;
+      } else {
+        return false;
+      }
+      return true;
+    }
+
+    /*
+     * Whether `path` is on a network or FUSE filesystem, where changes made
+     * by other machines (or by the FUSE daemon) never generate events
+     */
+    bool is_remote_filesystem(const string &path) {
+      struct statfs fs;
+      if (statfs(path.c_str(), &fs) != 0) {
+        return false;
+      }
+
+#ifdef __APPLE__
+      for (auto name : {"nfs", "smbfs", "afpfs", "webdav", "osxfuse", "macfuse", "fusefs"}) {
+        if (std::strncmp(fs.f_fstypename, name, std::strlen(name)) == 0) {
+          return true;
+        }
+      }
+      return false;
+#else
+      switch (static_cast<unsigned long>(fs.f_type)) {
+        case 0x6969:     // NFS
+        case 0x517B:     // SMB
+        case 0xFF534D42: // CIFS
+        case 0xFE534D42: // SMB2
+        case 0x65735546: // FUSE
+        case 0x01021997: // 9P
+        case 0x5346414F: // AFS
+        case 0x00C36400: // Ceph
+          return true;
+        default:
+          return false;
+      }
+#endif
+    }
+
+    /*
+     * Watches a tree by polling its directories. Only directories are
+     * stat'ed: adding, removing or renaming an entry changes its directory's
+     * mtime, and the whole directory is then reported, which Unison rescans.
+     *
+     * Every directory is polled on its own schedule. One that changed is
+     * polled again at the watch's latency, one that didn't waits twice as
+     * long as the last time, up to max_interval, so that a large quiet tree
+     * costs little while its busy parts are still seen quickly. Due
+     * directories are stat'ed in parallel by a Walker, which also walks any
+     * new subtree.
+     */
+    class PollWatch : public Watch {
+      using clock = std::chrono::steady_clock;
+
+      // What is known of a directory: whether it was replaced, whether its
+      // entries changed, and when to look again (in milliseconds since the
+      // watch started)
+      struct DirState {
+        ino_t ino;
+        int64_t mtime;
+        int64_t ctime;
+        uint32_t interval;
+        int64_t due;
+      };
+
+      struct Visit {
+        string path;
+        // Not in the table yet
+        bool fresh;
+      };
+
+      struct Seen {
+        string path;
+        DirState state;
+        bool fresh;
+        bool changed;
+      };
+
+      static const uint32_t max_interval = 30000;
+
+      Manager &_manager;
+      Reactor &_reactor;
+      string _root;
+      // Otherwise only the root itself is polled, not what is below it
+      bool _recursive;
+      std::atomic<double> _latency;
+      std::atomic<uint64_t> _events;
+      std::atomic<bool> _running;
+
+      std::thread _thread;
+      std::mutex _mutex;
+      std::condition_variable _cv;
+      bool _stopping;
+
+      // Only used by the polling thread
+      std::unordered_map<string, DirState> _dirs;
+      clock::time_point _started;
+
+      static int64_t nanoseconds(const struct timespec &ts) {
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+      }
+
+      static DirState dir_state(const struct stat &st) {
+#ifdef __APPLE__
+        return {st.st_ino, nanoseconds(st.st_mtimespec), nanoseconds(st.st_ctimespec), 0, 0};
+#else
+        return {st.st_ino, nanoseconds(st.st_mtim), nanoseconds(st.st_ctim), 0, 0};
+#endif
+      }
+
+      int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - this->_started).count();
+      }
+
+      uint32_t min_interval() const {
+        return std::max<uint32_t>(1, static_cast<uint32_t>(this->_latency.load() * 1000));
+      }
+
+      template <typename Push>
+      void visit(const Visit &visit, Push &push, vector<Seen> &seen, vector<string> &gone) {
+        struct stat st;
+        if (lstat(visit.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+          if (!visit.fresh) {
+            gone.push_back(visit.path);
+          }
+          return;
+        }
+
+        DirState state = dir_state(st);
+        bool changed = false;
+        if (!visit.fresh) {
+          // The table isn't modified while the walk is going on
+          auto &old = this->_dirs.at(visit.path);
+          changed = old.ino != state.ino || old.mtime != state.mtime || old.ctime != state.ctime;
+        }
+
+        // Look for new subdirectories
+        if (this->_recursive && (visit.fresh || changed)) {
+          read_directory(visit.path, [this, &visit, &push](const char *name, bool is_dir) {
+            if (!is_dir || is_excluded_name(name)) {
+              return;
+            }
+
+            string child = visit.path == "/" ? string("/") + name : visit.path + "/" + name;
+            if (visit.fresh || !this->_dirs.count(child)) {
+              push(Visit{child, true});
+            }
+          });
+        }
+
+        seen.push_back({visit.path, state, visit.fresh, changed});
+      }
+
+      /*
+       * Poll every directory that is due, or walk the whole tree when none
+       * is known: the first time, which reports nothing, or once the root
+       * is back after going away, which reports it as a whole
+       */
+      void poll(bool initial) {
+        int64_t now = this->now();
+        uint32_t min_interval = this->min_interval();
+
+        vector<Visit> due;
+        if (this->_dirs.empty()) {
+          due.push_back({this->_root, true});
+        } else {
+          for (auto &kv : this->_dirs) {
+            if (kv.second.due <= now) {
+              due.push_back({kv.first, false});
+            }
+          }
+        }
+
+        // Per worker
+        vector<vector<Seen>> seen(Walker<Visit>::count());
+        vector<vector<string>> gone(Walker<Visit>::count());
+        Walker<Visit>::run(std::move(due), [this, &seen, &gone](const Visit &visit, auto &push, size_t worker) {
+          this->visit(visit, push, seen[worker], gone[worker]);
+        });
+
+        vector<string> changed;
+        for (auto &results : seen) {
+          for (auto &s : results) {
+            uint32_t interval = min_interval;
+            if (s.fresh && !initial && s.path == this->_root) {
+              changed.push_back(s.path);
+            } else if (!s.fresh) {
+              auto &old = this->_dirs[s.path];
+              if (s.changed) {
+                changed.push_back(s.path);
+              } else {
+                interval = std::max(min_interval, old.interval * 2);
+                if (interval > max_interval) {
+                  interval = max_interval;
+                }
+              }
+            }
+
+            // New directories are reported along with their parent
+            s.state.interval = interval;
+            s.state.due = now + interval;
+            this->_dirs[s.path] = s.state;
+          }
+        }
+
+        for (auto &results : gone) {
+          for (auto &dir : results) {
+            // Its parent changed too, unless it is the root
+            if (dir == this->_root) {
+              changed.push_back(dir);
+            }
+
+            for (auto it = this->_dirs.begin(); it != this->_dirs.end();) {
+              if (path_contains(dir, it->first)) {
+                it = this->_dirs.erase(it);
+              } else {
+                ++it;
+              }
+            }
+          }
+        }
+
+        if (!initial && !changed.empty()) {
+          this->_events.fetch_add(changed.size(), std::memory_order_relaxed);
+          Manager &manager = this->_manager;
+          this->_reactor.post([&manager, changed]() {
+            manager.push_dir_changes(changed);
+          });
+        }
+      }
+
+      void run() {
+        this->_started = clock::now();
+        this->poll(true);
+
+        std::unique_lock<std::mutex> lock{this->_mutex};
+        while (!this->_stopping) {
+          this->_cv.wait_for(lock, std::chrono::duration<double>(this->_latency.load()));
+          if (this->_stopping) {
+            break;
+          }
+
+          lock.unlock();
+          this->poll(false);
+          lock.lock();
+        }
+      }
+
+    public:
+      PollWatch(Manager &manager, Reactor &reactor, const string &root, double latency, bool recursive = true) : _manager{manager},
+                                                                                                                 _reactor{reactor},
+                                                                                                                 _root{root},
+                                                                                                                 _recursive{recursive},
+                                                                                                                 _latency{latency},
+                                                                                                                 _events{0},
+                                                                                                                 _running{false},
+                                                                                                                 _stopping{false} {}
+
+      PollWatch(const PollWatch &) = delete;
+      PollWatch &operator=(const PollWatch &) = delete;
+
+      const string &root() const override {
+        return this->_root;
+      }
+
+      uint64_t event_count() const override {
+        return this->_events.load(std::memory_order_relaxed);
+      }
+
+      double latency() const override {
+        return this->_latency.load();
+      }
+
+      void set_latency(double latency) override {
+        double previous = this->_latency.exchange(latency);
+        // Don't sleep out the old latency when Unison starts waiting
+        if (latency < previous) {
+          std::lock_guard<std::mutex> guard{this->_mutex};
+          this->_cv.notify_all();
+        }
+      }
+
+      bool is_running() const override {
+        return this->_running.load();
+      }
+
+      void start() override {
+        if (!this->_running.exchange(true)) {
+          this->_thread = std::thread([this]() {
+            this->run();
+          });
+        }
+      }
+
+      void stop() override {
+        {
+          std::lock_guard<std::mutex> guard{this->_mutex};
+          this->_stopping = true;
+        }
+        this->_cv.notify_all();
+
+        if (this->_thread.joinable()) {
+          this->_thread.join();
+        }
+        this->_running = false;
+      }
+
+      ~PollWatch() override {
+        this->stop();
+      }
+    };
+  }
+}
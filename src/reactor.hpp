@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace fm {
+  namespace land {
+    /*
+     * A single threaded event loop. Readers are called when their fd is
+     * readable (or closed), writers when it is writable, timers once their
+     * delay has passed, and tasks
+     * posted from other threads as soon as the loop wakes up. Everything runs
+     * on the thread calling run(), so callbacks never race with each other.
+     */
+    class Reactor {
+    public:
+      using clock = std::chrono::steady_clock;
+      using callback_t = std::function<void()>;
+
+    private:
+      struct Timer {
+        clock::time_point when;
+        callback_t callback;
+      };
+
+      // Shared so that a reader removed while the loop is dispatching is
+      // still alive until its call returns
+      std::map<int, std::shared_ptr<callback_t>> _readers;
+      std::map<int, std::shared_ptr<callback_t>> _writers;
+      std::map<size_t, Timer> _timers;
+      size_t _next_timer;
+      bool _running;
+
+      std::mutex _posted_mutex;
+      std::vector<callback_t> _posted;
+      // Self pipe waking up poll() when a task is posted
+      int _wakeup[2];
+
+      void run_posted() {
+        char buf[64];
+        while (read(this->_wakeup[0], buf, sizeof(buf)) > 0) {
+        }
+
+        std::vector<callback_t> posted;
+        {
+          std::lock_guard<std::mutex> guard{this->_posted_mutex};
+          posted.swap(this->_posted);
+        }
+
+        for (auto &task : posted) {
+          task();
+        }
+      }
+
+      void run_timers() {
+        auto now = clock::now();
+        std::vector<size_t> due;
+        for (auto &kv : this->_timers) {
+          if (kv.second.when <= now) {
+            due.push_back(kv.first);
+          }
+        }
+
+        for (auto id : due) {
+          // A timer may have cancelled another one
+          auto found = this->_timers.find(id);
+          if (found != this->_timers.end()) {
+            auto callback = std::move(found->second.callback);
+            this->_timers.erase(found);
+            callback();
+          }
+        }
+      }
+
+      // Milliseconds until the next timer is due, -1 if there is none
+      int timeout() const {
+        if (this->_timers.empty()) {
+          return -1;
+        }
+
+        auto next = this->_timers.begin()->second.when;
+        for (auto &kv : this->_timers) {
+          next = std::min(next, kv.second.when);
+        }
+
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - clock::now()).count();
+        return ms < 0 ? 0 : static_cast<int>(ms) + 1;
+      }
+
+    public:
+      Reactor() : _next_timer(1), _running(false) {
+        if (pipe(this->_wakeup) == 0) {
+          for (int fd : this->_wakeup) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+          }
+        } else {
+          this->_wakeup[0] = this->_wakeup[1] = -1;
+        }
+      }
+
+      ~Reactor() {
+        for (int fd : this->_wakeup) {
+          if (fd >= 0) {
+            close(fd);
+          }
+        }
+      }
+
+      Reactor(const Reactor &) = delete;
+      Reactor &operator=(const Reactor &) = delete;
+
+      /*
+       * Call `callback` whenever `fd` is readable, replacing any previous
+       * reader of the fd. The callback should read at most once, so that it
+       * never blocks.
+       */
+      void add_reader(int fd, callback_t callback) {
+        this->_readers[fd] = std::make_shared<callback_t>(std::move(callback));
+      }
+
+      void remove_reader(int fd) {
+        this->_readers.erase(fd);
+      }
+
+      /*
+       * Call `callback` whenever `fd` is writable (or closed), until the
+       * writer is removed
+       */
+      void add_writer(int fd, callback_t callback) {
+        this->_writers[fd] = std::make_shared<callback_t>(std::move(callback));
+      }
+
+      void remove_writer(int fd) {
+        this->_writers.erase(fd);
+      }
+
+      size_t add_timer(clock::duration delay, callback_t callback) {
+        size_t id = this->_next_timer++;
+        this->_timers.emplace(id, Timer{clock::now() + delay, std::move(callback)});
+        return id;
+      }
+
+      void cancel_timer(size_t id) {
+        this->_timers.erase(id);
+      }
+
+      /*
+       * Run `task` on the loop. The only method that can be called from
+       * other threads.
+       */
+      void post(callback_t task) {
+        {
+          std::lock_guard<std::mutex> guard{this->_posted_mutex};
+          this->_posted.push_back(std::move(task));
+        }
+
+        char c = 0;
+        while (write(this->_wakeup[1], &c, 1) < 0 && errno == EINTR) {
+        }
+      }
+
+      void run() {
+        this->_running = true;
+        std::vector<pollfd> fds;
+
+        while (this->_running) {
+          fds.clear();
+          fds.push_back({this->_wakeup[0], POLLIN, 0});
+          for (auto &kv : this->_readers) {
+            fds.push_back({kv.first, POLLIN, 0});
+          }
+          size_t readers = fds.size();
+          for (auto &kv : this->_writers) {
+            fds.push_back({kv.first, POLLOUT, 0});
+          }
+
+          int n = poll(fds.data(), fds.size(), this->timeout());
+          if (n < 0 && errno != EINTR) {
+            break;
+          }
+
+          if (n > 0) {
+            if (fds[0].revents) {
+              this->run_posted();
+            }
+
+            for (size_t i = 1; i < fds.size() && this->_running; ++i) {
+              if (!fds[i].revents) {
+                continue;
+              }
+
+              // The callback may have been removed by an earlier one
+              auto &callbacks = i < readers ? this->_readers : this->_writers;
+              auto found = callbacks.find(fds[i].fd);
+              if (found != callbacks.end()) {
+                auto callback = found->second;
+                (*callback)();
+              }
+            }
+          }
+
+          this->run_timers();
+        }
+      }
+
+      void stop() {
+        this->_running = false;
+      }
+    };
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pathsplit.hpp"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace fm {
+  namespace land {
+    /*
+     * Values registered at absolute paths, looked up by every path they
+     * contain. Matching walks the components of a path once, only as deep as
+     * anything is registered, and reports each value found along the way with
+     * where the path relative to it starts.
+     */
+    class RootTrie {
+      struct Node {
+        map<string, Node, std::less<>> children;
+        vector<size_t> values;
+      };
+
+      Node _root;
+
+    public:
+      void insert(const vector<string_view> &components, size_t value) {
+        Node *node = &this->_root;
+        for (auto &comp : components) {
+          auto found = node->children.lower_bound(comp);
+          if (found == node->children.end() || found->first != comp) {
+            found = node->children.emplace_hint(found, string(comp.data(), comp.size()), Node());
+          }
+          node = &found->second;
+        }
+
+        node->values.push_back(value);
+      }
+
+      /*
+       * Call `f(value, offset)` for every value registered at the normalized
+       * absolute path `p` or one of its parents, outermost first. `offset` is
+       * where the rest of `p` relative to the value starts: it is either the
+       * end of `p` or a slash.
+       */
+      template <typename F>
+      void match(string_view p, F f) const {
+        const Node *node = &this->_root;
+        // "/" itself is registered with no components
+        size_t offset = p.size() == 1 ? 1 : 0;
+
+        while (true) {
+          for (auto value : node->values) {
+            f(value, offset);
+          }
+
+          if (offset >= p.size() || node->children.empty()) {
+            return;
+          }
+
+          size_t next = p.find('/', offset + 1);
+          if (next == string_view::npos) {
+            next = p.size();
+          }
+
+          auto found = node->children.find(p.substr(offset + 1, next - offset - 1));
+          if (found == node->children.end()) {
+            return;
+          }
+          node = &found->second;
+          offset = next;
+        }
+      }
+    };
+  }
+}
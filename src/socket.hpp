@@ -1,51 +1,112 @@
 #pragma once
 
-#include "json.hpp"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include "result.hpp"
+#include <array>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/iostreams/stream_buffer.hpp>
 #include <boost/iostreams/stream.hpp>
 
 namespace fm {
   namespace land {
-    using json = nlohmann::json;
     namespace io = boost::iostreams;
 
     result<int> connect_to_socket(std::string path) {
       sockaddr_un sa;
       memset(&sa, 0, sizeof(sa));
       sa.sun_family = AF_UNIX;
+      if (path.length() >= sizeof(sa.sun_path)) {
+        return err("Socket path too long: " + path);
+      }
       memcpy(sa.sun_path, path.c_str(), path.length());
 
       int fd = socket(AF_UNIX, SOCK_STREAM, 0);
       if (fd < 0) {
-        return err("Error creating socket");
+        return err(std::string("Error creating socket"));
       }
 
       if (connect(fd, (sockaddr *) &sa, sizeof(sa)) < 0) {
-        return err("Error creating socket");
+        close(fd);
+        return err("Error connecting to socket " + path);
       }
 
       return ok(fd);
     }
 
-    result<size_t> send(int fd, const char* req) {
-      size_t s = strlen(req);
+    /*
+     * Create a unix socket at `path` and start listening on it, only
+     * accessible to the current user. A stale socket left behind by a
+     * previous process is replaced, one another process still listens on is
+     * not.
+     */
+    result<int> listen_on_socket(std::string path) {
+      sockaddr_un sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sun_family = AF_UNIX;
+      if (path.length() >= sizeof(sa.sun_path)) {
+        return err("Socket path too long: " + path);
+      }
+      memcpy(sa.sun_path, path.c_str(), path.length());
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0) {
+        return err(std::string("Error creating socket"));
+      }
+
+      auto running = connect_to_socket(path);
+      if (running) {
+        close(running.unwrap());
+        close(fd);
+        return err("Another process is listening on " + path);
+      }
+
+      unlink(path.c_str());
+      // The socket is created with the umask's permissions, which is the
+      // only way to restrict it before anyone can connect
+      mode_t mask = umask(0077);
+      int bound = bind(fd, (sockaddr *) &sa, sizeof(sa));
+      umask(mask);
+      if (bound < 0) {
+        close(fd);
+        return err("Error binding socket " + path);
+      }
+
+      if (listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return err("Error listening on socket " + path);
+      }
+
+      return ok(fd);
+    }
+
+    result<size_t> write_all(int fd, const char *buf, size_t s) {
       size_t written = 0;
 
-      while (true) {
-        written += write(fd, req, s - written);
-        if (written == s) { break; }
+      while (written < s) {
+        ssize_t n = write(fd, buf + written, s - written);
+        if (n < 0) {
+          if (errno == EINTR) { continue; }
+          return err(std::string("Error writing to socket"));
+        }
+        written += n;
       }
 
       return ok(written);
     }
 
+    result<size_t> send(int fd, const char* req) {
+      return write_all(fd, req, strlen(req));
+    }
+
     result<std::string> recv(int fd) {
       io::file_descriptor_source src(fd, io::never_close_handle);
       io::stream_buffer<io::file_descriptor_source> fpstream(src);
@@ -62,7 +123,7 @@ namespace fm {
       }
 
       if (in.fail() || in.eof()) {
-        return err("Failed to extract response from watchman");
+        return err(std::string("Failed to extract response from watchman"));
       }
 
       return ok(sstream.str());
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace fm {
+  namespace land {
+    /*
+     * The metadata of the files that got events lately, so that an event
+     * that changed nothing about its file (a rewrite of the same metadata,
+     * a duplicate of an event already seen) can be told apart and dropped.
+     *
+     * Paths are stored once, in the entries, and the index points to them.
+     * The least recently seen entries are dropped past `capacity`.
+     */
+    class StatCache {
+      struct Entry {
+        std::string path;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime;
+        int64_t ctime;
+      };
+
+      struct PathHash {
+        size_t operator()(const std::string *p) const {
+          return std::hash<std::string>()(*p);
+        }
+      };
+
+      struct PathEqual {
+        bool operator()(const std::string *a, const std::string *b) const {
+          return *a == *b;
+        }
+      };
+
+      // Most recently seen first
+      std::list<Entry> _entries;
+      std::unordered_map<const std::string *, std::list<Entry>::iterator, PathHash, PathEqual> _index;
+      size_t _capacity;
+      std::mutex _mutex;
+
+      static bool stat(const std::string &path, Entry &entry, bool &is_dir) {
+#ifdef STATX_BASIC_STATS
+        // Only what is compared, which spares network filesystems the rest
+        struct statx st;
+        if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &st) != 0) {
+          return false;
+        }
+        is_dir = S_ISDIR(st.stx_mode);
+        entry.ino = st.stx_ino;
+        entry.size = st.stx_size;
+        entry.mtime = static_cast<int64_t>(st.stx_mtime.tv_sec) * 1000000000 + st.stx_mtime.tv_nsec;
+        entry.ctime = static_cast<int64_t>(st.stx_ctime.tv_sec) * 1000000000 + st.stx_ctime.tv_nsec;
+#else
+        struct ::stat st;
+        if (lstat(path.c_str(), &st) != 0) {
+          return false;
+        }
+        is_dir = S_ISDIR(st.st_mode);
+        entry.ino = st.st_ino;
+        entry.size = st.st_size;
+#ifdef __APPLE__
+        entry.mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+        entry.ctime = static_cast<int64_t>(st.st_ctimespec.tv_sec) * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+        entry.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        entry.ctime = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+#endif
+        return true;
+      }
+
+    public:
+      explicit StatCache(size_t capacity) : _capacity(capacity) {}
+
+      StatCache(const StatCache &) = delete;
+      StatCache &operator=(const StatCache &) = delete;
+
+      /*
+       * Whether the file at `path` has the same metadata as on its last
+       * event, remembering what it has now. A file that can't be stat'ed,
+       * because it is gone, has always changed, and so has a directory, as
+       * writing to a file in it leaves its metadata alone.
+       */
+      bool unchanged(const std::string &path) {
+        Entry current;
+        bool is_dir = false;
+        bool exists = stat(path, current, is_dir);
+
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        auto found = this->_index.find(&path);
+
+        if (!exists || is_dir) {
+          if (found != this->_index.end()) {
+            auto entry = found->second;
+            this->_index.erase(found);
+            this->_entries.erase(entry);
+          }
+          return false;
+        }
+
+        if (found != this->_index.end()) {
+          auto entry = found->second;
+          bool same = entry->ino == current.ino && entry->size == current.size &&
+                      entry->mtime == current.mtime && entry->ctime == current.ctime;
+          entry->ino = current.ino;
+          entry->size = current.size;
+          entry->mtime = current.mtime;
+          entry->ctime = current.ctime;
+          this->_entries.splice(this->_entries.begin(), this->_entries, entry);
+          return same;
+        }
+
+        current.path = path;
+        this->_entries.push_front(std::move(current));
+        this->_index.emplace(&this->_entries.front().path, this->_entries.begin());
+
+        if (this->_entries.size() > this->_capacity) {
+          this->_index.erase(&this->_entries.back().path);
+          this->_entries.pop_back();
+        }
+        return false;
+      }
+
+      size_t size() {
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        return this->_entries.size();
+      }
+    };
+  }
+}
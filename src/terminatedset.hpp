@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "pathsplit.hpp"
+
+namespace fm {
+  namespace land {
+    /*
+     * The paths recently terminated in a change tree, so that more events
+     * under them can be recognized with one probe instead of a walk down the
+     * tree. A small open-addressing table: slots keep their strings when it
+     * is cleared, so it stops allocating once warm, and it is simply cleared
+     * when half full.
+     */
+    class TerminatedSet {
+      struct Slot {
+        uint64_t hash;
+        std::string path;
+        bool used;
+      };
+
+      static const size_t capacity = 256;
+
+      std::vector<Slot> _slots;
+      size_t _size;
+
+      static uint64_t hash(string_view path) {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ull;
+        for (char c : path) {
+          h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return h;
+      }
+
+      // The slot holding `path`, or the free one where it would go
+      Slot &probe(string_view path, uint64_t h) {
+        for (size_t i = h & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+          auto &slot = this->_slots[i];
+          if (!slot.used || (slot.hash == h && slot.path == path)) {
+            return slot;
+          }
+        }
+      }
+
+    public:
+      TerminatedSet() : _slots(capacity), _size(0) {
+        for (auto &slot : this->_slots) {
+          slot.used = false;
+        }
+      }
+
+      bool contains(string_view path) {
+        if (this->_size == 0) {
+          return false;
+        }
+        return this->probe(path, hash(path)).used;
+      }
+
+      void insert(string_view path) {
+        if (this->_size >= capacity / 2) {
+          this->clear();
+        }
+
+        uint64_t h = hash(path);
+        auto &slot = this->probe(path, h);
+        if (!slot.used) {
+          slot.hash = h;
+          slot.path.assign(path.data(), path.size());
+          slot.used = true;
+          ++this->_size;
+        }
+      }
+
+      void clear() {
+        if (this->_size == 0) {
+          return;
+        }
+        for (auto &slot : this->_slots) {
+          slot.used = false;
+        }
+        this->_size = 0;
+      }
+    };
+  }
+}
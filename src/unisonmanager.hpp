@@ -1,5 +1,8 @@
+#pragma once
+
 #include <algorithm>
 #include <condition_variable>
+#include <future>
 #include <mutex>
 #include <numeric>
 #include <set>
@@ -14,7 +17,10 @@
 #include "fswatchmanager.hpp"
 #include "glib.h"
 #include "manager.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
 #include "result.hpp"
+#include "workerpool.hpp"
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 
@@ -32,20 +38,60 @@ namespace fm {
   namespace land {
     class UnisonManager {
       Manager &_manager;
-      set<string> _waiting;
-      mutex _waiting_mutex;
+      std::ostream &_out;
+      Manager::client_t _client;
+      size_t _fs_change_listener;
       mutex _stdout_mutex;
+      // Between START and DONE, while Unison is scanning a replica: the
+      // replica and the path it started from
+      bool _scanning;
+      string _scan_hash;
+      string _scan_path;
+      // Input read from the fd that doesn't make a full line yet
+      string _pending_input;
+
+      // A CHANGES response built once Unison has been notified, before it
+      // asks for it, and kept up to date as more changes come in
+      struct Prepared {
+        string lines;
+        // The client's cursor when the response was started, the response
+        // is only valid as long as it hasn't moved
+        epoch_t since;
+        // Changes up to this epoch are in the response
+        epoch_t epoch;
+      };
+
+      // By replica hash
+      mutex _prepared_mutex;
+      map<string, Prepared> _prepared;
+
+      // Set by attach, the prepared responses are then refreshed on a timer
+      // rather than on every batch of events
+      Reactor *_reactor;
+      size_t _refresh_timer;
+      std::set<string> _stale;
+
+      void update_prepared(const string &hash, Prepared &prepared);
+      void schedule_refresh(const string &hash);
 
     public:
-      UnisonManager(Manager &manager);
+      UnisonManager(Manager &manager, std::ostream &out = std::cout);
+      ~UnisonManager();
       void send(const string &command, const vector<string> &args);
+      void write(const string &lines);
       void ack();
+      bool connected() const;
       Manager &manager();
-      void start();
-      bool is_waiting(const string &hash);
-      vector<string> waiting();
+      Manager::client_t client() const;
+      void attach(Reactor &reactor, int fd, std::function<void()> on_close);
+      void handle_line(const string &input);
+      void set_scanning(bool scanning, const string &hash = "", const string &path = "");
       void wait(const string &hash);
       void clear_waiting();
+      void notify_changes();
+      void prepare_changes(const string &hash);
+      void refresh_prepared(const string &hash);
+      epoch_t take_changes(const string &hash, string &lines);
     };
 
     std::string urlencode(const std::string &s) {
@@ -76,18 +122,6 @@ namespace fm {
       return transformed_result;
     }
 
-    result<string> receive() {
-      string input;
-      std::getline(std::cin, input);
-      if (std::cin.eof()) {
-        return err(string("stdin closed"));
-      }
-
-      boost::trim(input);
-      D(log(">>> Received \"" + input + "\""));
-      return ok(input);
-    }
-
     class Command {
       UnisonManager &_unison_manager;
 
@@ -98,35 +132,126 @@ namespace fm {
         return this->_unison_manager.manager();
       }
 
+      Manager::client_t client() const {
+        return this->_unison_manager.client();
+      }
+
+      bool connected() const {
+        return this->_unison_manager.connected();
+      }
+
       void send(const string &command, const vector<string> &args) {
         this->_unison_manager.send(command, args);
       }
+      void write(const string &lines) {
+        this->_unison_manager.write(lines);
+      }
       void ack() {
         this->_unison_manager.ack();
       }
+      void scanning(bool scanning, const string &hash = "", const string &path = "") {
+        this->_unison_manager.set_scanning(scanning, hash, path);
+      }
+      epoch_t take_changes(const string &hash, string &lines) {
+        return this->_unison_manager.take_changes(hash, lines);
+      }
     };
 
     class ChangesCommand : Command {
+      // Below this many nodes a tree is cheaper to encode on a single thread
+      static const size_t parallel_threshold = 4096;
+
     public:
       ChangesCommand(UnisonManager &unison_manager) : Command{unison_manager} {}
 
       void process(const vector<string> &args) {
+        ScopedTimer timer{metrics().changes_response};
         string hash = args[0];
-        Directory dir = this->manager().consume_directory(hash);
+        string response;
+
+        // Usually encoded already, while Unison was getting to ask
+        epoch_t epoch = this->take_changes(hash, response);
 
-        this->send_recursive(path("."), dir);
+        response += "DONE\n";
+        this->write(response);
 
-        this->send("DONE", {});
+        // The changes are only consumed once Unison has actually been told
+        // about them, a failed write leaves them for the next CHANGES
+        if (this->connected()) {
+          this->manager().acknowledge(this->client(), hash, epoch);
+        }
       }
 
-      void send_recursive(const path &p, const Directory &dir) {
-        if (dir.terminated()) {
-          this->send("RECURSIVE", {p.string()});
+      static void encode_recursive(const path &p, const Directory &dir, epoch_t since, string &out) {
+        if (dir.terminated_since(since)) {
+          out += "RECURSIVE ";
+          out += urlencode(p.string());
+          out.push_back('\n');
         } else {
-          dir.each_child([this, &p](const string &comp, const Directory &dir2) {
-            this->send_recursive(p / path(comp), dir2);
+          dir.each_child([&p, since, &out](const string &comp, const Directory &dir2) {
+            if (dir2.has_changes_since(since)) {
+              encode_recursive(p / path(comp), dir2, since, out);
+            }
+          });
+        }
+      }
+
+      /*
+       * The RECURSIVE lines for every change newer than `since`. Large trees
+       * are split below their first directory with several changed children,
+       * into contiguous ranges of children that are encoded in parallel and
+       * concatenated in the same order a serial walk would produce.
+       */
+      static string encode_changes(const Directory &dir, epoch_t since) {
+        string out;
+
+        if (workers().size() < 2 || !dir.larger_than(parallel_threshold)) {
+          encode_recursive(path("."), dir, since, out);
+          return out;
+        }
+
+        // Skip down chains of single changed children
+        path prefix(".");
+        const Directory *split = &dir;
+        vector<std::pair<const string *, const Directory *>> children;
+        while (true) {
+          if (split->terminated_since(since)) {
+            encode_recursive(prefix, *split, since, out);
+            return out;
+          }
+
+          children.clear();
+          split->each_child([since, &children](const string &comp, const Directory &child) {
+            if (child.has_changes_since(since)) {
+              children.emplace_back(&comp, &child);
+            }
           });
+
+          if (children.size() != 1) {
+            break;
+          }
+          prefix /= path(*children[0].first);
+          split = children[0].second;
+        }
+
+        size_t ranges = std::min(children.size(), workers().size() * 4);
+        vector<std::future<string>> parts;
+        for (size_t i = 0; i < ranges; ++i) {
+          size_t begin = children.size() * i / ranges;
+          size_t end = children.size() * (i + 1) / ranges;
+          parts.push_back(workers().submit([&prefix, &children, begin, end, since]() {
+            string part;
+            for (size_t j = begin; j < end; ++j) {
+              encode_recursive(prefix / path(*children[j].first), *children[j].second, since, part);
+            }
+            return part;
+          }));
         }
+
+        for (auto &part : parts) {
+          out += part.get();
+        }
+        return out;
       }
     };
 
@@ -137,55 +262,34 @@ namespace fm {
       void process(const vector<string> &args) {
         string hash = args[0];
         string fspath = args[1];
-        string path;
-
-        if (!this->manager().has_replica(hash)) {
-          // Add the replica to the manager
-          if (args.size() == 3) {
-            this->manager().add_replica({hash, fspath, {path}});
-          } else if (args.size() == 2) {
-            this->manager().add_replica({hash, fspath});
-          }
-        }
 
-        this->ack();
-
-        result<string> result{ok(string(""))};
-        string input;
-        vector<string> command_words;
-        string command;
-
-        while (true) {
-          result = receive();
-
-          if (!result) {
-            // Close the input
-            break;
-          }
+        this->manager().subscribe(this->client(), hash);
 
-          input = result.unwrap();
+        // Add the replica to the manager, or the part of it being scanned to
+        // the replica we know
+        if (args.size() >= 3) {
+          this->manager().add_replica({hash, fspath, {args[2]}});
+        } else {
+          this->manager().add_replica({hash, fspath, {""}});
+        }
 
-          command_words = process_args(input);
-          command = command_words[0];
+        this->ack();
 
-          if (command == "DONE") {
-            break;
-          } else if (command == "DIR") {
-            this->ack();
-          } else if (command == "LINK") {
-            this->ack();
-          }
-        }
+        // The DIR, LINK and DONE commands that follow are handled by
+        // UnisonManager::handle_line until Unison is done scanning
+        this->scanning(true, hash, args.size() >= 3 ? args[2] : "");
       }
     };
 
-    UnisonManager::UnisonManager(Manager &manager) : _manager{manager} {
-      manager.on_fs_change([this](const string &hash) {
-        if (this->is_waiting(hash)) {
-          auto changed = this->_manager.changed_replicas(this->waiting());
-          this->clear_waiting();
-          this->send("CHANGES", changed);
-        }
+    UnisonManager::UnisonManager(Manager &manager, std::ostream &out) : _manager{manager},
+                                                                         _out{out},
+                                                                         _client{manager.connect()},
+                                                                         _scanning{false},
+                                                                         _reactor{nullptr},
+                                                                         _refresh_timer{0} {
+      this->_fs_change_listener = manager.on_fs_change([this](const string &hash) {
+        this->schedule_refresh(hash);
+        this->notify_changes();
       });
     }
 
@@ -206,34 +310,156 @@ namespace fm {
                                               });
 
       std::lock_guard<std::mutex> lock(this->_stdout_mutex);
-      std::cout << command_string << std::endl;
-      std::cout.flush();
-      D(log("<<< Sent \"" + command_string + "\""));
+      this->_out << command_string << std::endl;
+      this->_out.flush();
+      LOG_DEBUG("<<< Sent \"" + command_string + "\"");
+    }
+
+    /*
+     * Write lines that are already encoded and terminated
+     */
+    void UnisonManager::write(const string &lines) {
+      std::lock_guard<std::mutex> lock(this->_stdout_mutex);
+      this->_out << lines;
+      this->_out.flush();
+      LOG_DEBUG("<<< Sent " + std::to_string(std::count(lines.begin(), lines.end(), '\n')) + " lines");
+    }
+
+    UnisonManager::~UnisonManager() {
+      this->_manager.off_fs_change(this->_fs_change_listener);
+      if (this->_refresh_timer != 0) {
+        this->_reactor->cancel_timer(this->_refresh_timer);
+      }
+      this->_manager.disconnect(this->_client);
     }
+
     void UnisonManager::ack() {
       this->send("OK", {});
     }
 
+    bool UnisonManager::connected() const {
+      return this->_out.good();
+    }
+
     Manager &UnisonManager::manager() {
       return this->_manager;
     }
 
-    bool UnisonManager::is_waiting(const string &hash) {
-      lock_guard<mutex> lock(this->_waiting_mutex);
-      return this->_waiting.find(hash) != this->_waiting.end();
+    Manager::client_t UnisonManager::client() const {
+      return this->_client;
     }
 
     void UnisonManager::wait(const string &hash) {
-      lock_guard<mutex> lock(this->_waiting_mutex);
-      this->_waiting.insert(hash);
-    }
-    vector<string> UnisonManager::waiting() {
-      lock_guard<mutex> lock(this->_waiting_mutex);
-      return {this->_waiting.begin(), this->_waiting.end()};
+      this->_manager.wait(this->_client, hash);
     }
+
     void UnisonManager::clear_waiting() {
-      lock_guard<mutex> lock(this->_waiting_mutex);
-      this->_waiting.clear();
+      this->_manager.clear_waits(this->_client);
+    }
+
+    /*
+     * Send CHANGES if a replica we are waiting on has changed
+     */
+    void UnisonManager::notify_changes() {
+      auto changed = this->_manager.take_changes(this->_client);
+      if (changed.size() > 0) {
+        this->send("CHANGES", changed);
+        for (auto &changed_hash : changed) {
+          metrics().notified(changed_hash);
+        }
+
+        // Unison answers right away, the responses are encoded in the
+        // meantime
+        for (auto &changed_hash : changed) {
+          this->prepare_changes(changed_hash);
+        }
+      }
+    }
+
+    /*
+     * Bring the response prepared for the replica up to date, only encoding
+     * what changed since it was last updated. Must be called with
+     * _prepared_mutex held.
+     */
+    void UnisonManager::update_prepared(const string &hash, Prepared &prepared) {
+      // Only encode the paths while the change tree is locked, the writing
+      // happens once it has been released
+      epoch_t epoch = this->_manager.read_changes(this->_client, hash, [&prepared](const Directory &dir, epoch_t since) {
+        if (prepared.epoch == 0 || since != prepared.since) {
+          prepared.lines = ChangesCommand::encode_changes(dir, since);
+          prepared.since = since;
+        } else {
+          // A path may be repeated, or covered by one already there, which
+          // Unison doesn't mind
+          prepared.lines += ChangesCommand::encode_changes(dir, prepared.epoch);
+        }
+      });
+      prepared.epoch = epoch;
+    }
+
+    /*
+     * Start building the CHANGES response for the replica, after notifying
+     * Unison
+     */
+    void UnisonManager::prepare_changes(const string &hash) {
+      lock_guard<mutex> guard{this->_prepared_mutex};
+      this->update_prepared(hash, this->_prepared[hash]);
+    }
+
+    /*
+     * Add the changes that just came in to the response prepared for the
+     * replica, if there is one
+     */
+    void UnisonManager::refresh_prepared(const string &hash) {
+      lock_guard<mutex> guard{this->_prepared_mutex};
+      auto found = this->_prepared.find(hash);
+      if (found != this->_prepared.end()) {
+        this->update_prepared(hash, found->second);
+      }
+    }
+
+    /*
+     * Refresh the response prepared for the replica soon, along with every
+     * other one that changed in the meantime. Each refresh encodes under the
+     * change set's lock, doing it once for many batches of events keeps the
+     * lock free for them. Without a reactor it is refreshed right away.
+     */
+    void UnisonManager::schedule_refresh(const string &hash) {
+      if (!this->_reactor) {
+        this->refresh_prepared(hash);
+        return;
+      }
+
+      this->_stale.insert(hash);
+      if (this->_refresh_timer != 0) {
+        return;
+      }
+
+      // Short enough to stay ahead of Unison's CHANGES, which take_changes
+      // brings up to date anyway
+      this->_refresh_timer = this->_reactor->add_timer(std::chrono::milliseconds(50), [this]() {
+        this->_refresh_timer = 0;
+        std::set<string> stale;
+        stale.swap(this->_stale);
+        for (auto &hash : stale) {
+          this->refresh_prepared(hash);
+        }
+      });
+    }
+
+    /*
+     * The RECURSIVE lines for every change to the replica the client hasn't
+     * consumed, along with the epoch to acknowledge once they are delivered
+     */
+    epoch_t UnisonManager::take_changes(const string &hash, string &lines) {
+      lock_guard<mutex> guard{this->_prepared_mutex};
+      auto &prepared = this->_prepared[hash];
+      this->update_prepared(hash, prepared);
+
+      epoch_t epoch = prepared.epoch;
+      lines = std::move(prepared.lines);
+      this->_prepared.erase(hash);
+      return epoch;
     }
 
     /*
@@ -281,61 +507,106 @@ namespace fm {
         pending change information for this replica.
        */
 
-    void UnisonManager::start() {
-      string input;
-      result<string> result{ok(string(""))};
-      string command;
-      vector<string> command_words;
-      vector<string> args;
-
-      // Output our version
+    /*
+     * Serve the protocol on `fd` from the reactor. `on_close` is called on
+     * the reactor once the input is closed.
+     */
+    void UnisonManager::attach(Reactor &reactor, int fd, std::function<void()> on_close) {
+      this->_reactor = &reactor;
       this->send("VERSION", {"1"});
 
-      while (true) {
-        result = receive();
+      reactor.add_reader(fd, [this, &reactor, fd, on_close]() {
+        char buf[4096];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+          return;
+        }
 
-        if (!result) {
-          break;
+        if (n <= 0) {
+          LOG_DEBUG("Input closed");
+          reactor.remove_reader(fd);
+          on_close();
+          return;
         }
 
-        input = result.unwrap();
+        this->_pending_input.append(buf, n);
 
-        command_words = process_args(input);
-        if (command_words.size() == 0) {
-          continue;
+        size_t start = 0;
+        size_t newline;
+        while ((newline = this->_pending_input.find('\n', start)) != string::npos) {
+          string line = this->_pending_input.substr(start, newline - start);
+          boost::trim(line);
+          LOG_DEBUG(">>> Received \"" + line + "\"");
+          this->handle_line(line);
+          start = newline + 1;
         }
+        this->_pending_input.erase(0, start);
+      });
+    }
 
-        // Grab the command
-        command = command_words[0];
+    void UnisonManager::set_scanning(bool scanning, const string &hash, const string &path) {
+      this->_scanning = scanning;
+      this->_scan_hash = hash;
+      this->_scan_path = path;
 
-        if (command_words.size() > 1) {
-          args = vector<string>(std::make_move_iterator(++command_words.begin()),
-                                std::make_move_iterator(command_words.end()));
-        } else {
-          args = {};
-        }
+      if (scanning) {
+        this->_manager.scan_started(this->_client, hash, path);
+      } else {
+        this->_manager.scan_done(this->_client);
+      }
+    }
 
-        // If we receive a command other than a wait command, clear our waiting set
-        if (command != "WAIT") {
-          this->clear_waiting();
-        }
+    void UnisonManager::handle_line(const string &input) {
+      vector<string> command_words = process_args(input);
+      if (command_words.size() == 0 || command_words[0].empty()) {
+        return;
+      }
 
-        if (command == "START") {
-          StartCommand(*this).process(args);
-        } else if (command == "CHANGES") {
-          ChangesCommand(*this).process(args);
-        } else if (command == "WAIT") {
-          string hash = args[0];
-
-          auto changed = this->_manager.changed_replicas(this->waiting());
-          if (changed.size() > 0) {
-            this->send("CHANGES", changed);
-          } else {
-            this->wait(hash);
+      // Grab the command
+      string command = command_words[0];
+      vector<string> args(std::make_move_iterator(++command_words.begin()),
+                          std::make_move_iterator(command_words.end()));
+
+      ScopedTimer timer{metrics().command};
+
+      if (this->_scanning) {
+        if (command == "DONE") {
+          this->set_scanning(false);
+        } else if (command == "DIR") {
+          this->ack();
+        } else if (command == "LINK") {
+          // The target is watched before Unison goes on scanning it
+          if (args.size() > 0) {
+            string link = this->_scan_path.empty() ? args[0] : this->_scan_path + "/" + args[0];
+            this->_manager.add_link(this->_scan_hash, link);
           }
-        } else if (command == "RESET") {
+          this->ack();
         }
+        return;
       }
-    };
+
+      // If we receive a command other than a wait command, clear our waiting set
+      if (command != "WAIT") {
+        this->clear_waiting();
+      }
+
+      if (command == "START" && args.size() >= 2) {
+        StartCommand(*this).process(args);
+      } else if (command == "CHANGES" && args.size() > 0) {
+        ChangesCommand(*this).process(args);
+      } else if (command == "WAIT" && args.size() > 0) {
+        // Wait first, so that changes recorded from here on notify us,
+        // then pick up the ones that were already there
+        this->wait(args[0]);
+        this->notify_changes();
+      } else if (command == "RESET") {
+        if (args.size() > 0) {
+          this->_manager.unsubscribe(this->_client, args[0]);
+
+          lock_guard<mutex> guard{this->_prepared_mutex};
+          this->_prepared.erase(args[0]);
+        }
+      }
+    }
   }
 }
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "workerpool.hpp"
+
+namespace fm {
+  namespace land {
+#ifdef __linux__
+    namespace detail {
+      struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+      };
+    }
+#endif
+
+    /*
+     * Call `f(name, is_dir)` for every entry of the directory at `dir`, but
+     * "." and "..". Returns false if it can't be read.
+     *
+     * On Linux the entries are read with getdents64 into one buffer, without
+     * the per-entry overhead of readdir. Filesystems that don't report entry
+     * types (some FUSE ones) cost a stat per entry.
+     */
+    template <typename F>
+    bool read_directory(const std::string &dir, F f) {
+      int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) {
+        return false;
+      }
+
+      auto is_dir = [fd](const char *name, unsigned char type) {
+        if (type != DT_UNKNOWN) {
+          return type == DT_DIR;
+        }
+        struct stat st;
+        return fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+      };
+
+      auto skip = [](const char *name) {
+        return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+      };
+
+#ifdef __linux__
+      alignas(detail::linux_dirent64) char buf[32768];
+      while (true) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          close(fd);
+          return n == 0;
+        }
+
+        for (long offset = 0; offset < n;) {
+          auto *entry = reinterpret_cast<detail::linux_dirent64 *>(buf + offset);
+          if (!skip(entry->d_name)) {
+            f(entry->d_name, is_dir(entry->d_name, entry->d_type));
+          }
+          offset += entry->d_reclen;
+        }
+      }
+#else
+      DIR *d = fdopendir(fd);
+      if (!d) {
+        close(fd);
+        return false;
+      }
+
+      while (struct dirent *entry = readdir(d)) {
+        if (!skip(entry->d_name)) {
+          f(entry->d_name, is_dir(entry->d_name, entry->d_type));
+        }
+      }
+      closedir(d);
+      return true;
+#endif
+    }
+
+    /*
+     * Runs `visit(item, push, worker)` over a set of items and over
+     * everything the visits push, in parallel. Every worker takes from the
+     * back of its own queue, so a walk goes depth first and stays local, and
+     * steals from the front of the others' when it runs out, where the
+     * biggest pieces of work are.
+     *
+     * `worker` is below Walker::count(), so that visits can gather their
+     * results per worker without locking, and merge them once the walk is
+     * over. The calling thread is one of the workers, so the walk goes on
+     * even if the shared pool is busy.
+     */
+    template <typename T>
+    class Walker {
+      struct Queue {
+        std::mutex mutex;
+        std::deque<T> items;
+      };
+
+      std::vector<Queue> _queues;
+      // Items pushed and not visited yet, the walk is done once it's 0
+      std::atomic<size_t> _pending;
+      // Items in the queues
+      std::atomic<size_t> _queued;
+
+      // Workers with nothing to take sleep until something is pushed or the
+      // walk is done
+      std::mutex _idle_mutex;
+      std::condition_variable _idle;
+      std::atomic<size_t> _idle_count;
+
+      bool take(size_t worker, T &item) {
+        {
+          auto &own = this->_queues[worker];
+          std::lock_guard<std::mutex> guard{own.mutex};
+          if (!own.items.empty()) {
+            item = std::move(own.items.back());
+            own.items.pop_back();
+            this->_queued.fetch_sub(1);
+            return true;
+          }
+        }
+
+        for (size_t i = 1; i < this->_queues.size(); ++i) {
+          auto &other = this->_queues[(worker + i) % this->_queues.size()];
+          std::lock_guard<std::mutex> guard{other.mutex};
+          if (!other.items.empty()) {
+            item = std::move(other.items.front());
+            other.items.pop_front();
+            this->_queued.fetch_sub(1);
+            return true;
+          }
+        }
+
+        return false;
+      }
+
+      void wake(bool all) {
+        // Taking the lock makes sure a worker going idle has either seen
+        // the change or is already waiting
+        std::lock_guard<std::mutex> guard{this->_idle_mutex};
+        if (all) {
+          this->_idle.notify_all();
+        } else {
+          this->_idle.notify_one();
+        }
+      }
+
+      template <typename F>
+      void work(size_t worker, F &visit) {
+        auto push = [this, worker](T item) {
+          this->_pending.fetch_add(1);
+          {
+            auto &own = this->_queues[worker];
+            std::lock_guard<std::mutex> guard{own.mutex};
+            own.items.push_back(std::move(item));
+          }
+          this->_queued.fetch_add(1);
+          if (this->_idle_count.load() > 0) {
+            this->wake(false);
+          }
+        };
+
+        T item;
+        while (true) {
+          if (this->take(worker, item)) {
+            visit(item, push, worker);
+            if (this->_pending.fetch_sub(1) == 1) {
+              this->wake(true);
+            }
+            continue;
+          }
+
+          // Someone is still visiting, and may push more
+          std::unique_lock<std::mutex> lock{this->_idle_mutex};
+          this->_idle_count.fetch_add(1);
+          this->_idle.wait(lock, [this]() {
+            return this->_queued.load() > 0 || this->_pending.load() == 0;
+          });
+          this->_idle_count.fetch_sub(1);
+          if (this->_pending.load() == 0) {
+            return;
+          }
+        }
+      }
+
+      Walker(size_t count) : _queues(count), _pending(0), _queued(0), _idle_count(0) {}
+
+    public:
+      static size_t count() {
+        return workers().size() + 1;
+      }
+
+      template <typename F>
+      static void run(std::vector<T> items, F visit) {
+        if (items.empty()) {
+          return;
+        }
+
+        Walker walker{count()};
+        walker._pending = items.size();
+        walker._queued = items.size();
+        for (size_t i = 0; i < items.size(); ++i) {
+          walker._queues[i % walker._queues.size()].items.push_back(std::move(items[i]));
+        }
+
+        std::vector<std::future<void>> helpers;
+        for (size_t worker = 1; worker < walker._queues.size(); ++worker) {
+          helpers.push_back(workers().submit([&walker, &visit, worker]() {
+            walker.work(worker, visit);
+          }));
+        }
+
+        walker.work(0, visit);
+        // The helpers may still be on their last visit
+        for (auto &helper : helpers) {
+          helper.get();
+        }
+      }
+    };
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace fm {
+  namespace land {
+    /*
+     * Entries that are never watched nor reported, like the filters of
+     * FSWatch
+     */
+    bool is_excluded_name(const char *name) {
+      return std::strcmp(name, ".git") == 0 || std::strcmp(name, ".hg") == 0 || std::strcmp(name, ".DS_Store") == 0;
+    }
+
+    /*
+     * Something watching a directory recursively and feeding what changes in
+     * it to the Manager, whatever the way it finds out
+     */
+    class Watch {
+    public:
+      virtual ~Watch() {}
+
+      virtual const std::string &root() const = 0;
+      // Every event seen so far, for the latency policy
+      virtual uint64_t event_count() const = 0;
+      virtual double latency() const = 0;
+      virtual void set_latency(double latency) = 0;
+      virtual bool is_running() const = 0;
+      virtual void start() = 0;
+      virtual void stop() = 0;
+    };
+  }
+}
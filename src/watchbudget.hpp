@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace fm {
+  namespace land {
+    /*
+     * Something holding kernel watches on directories, that can give some up
+     * and poll those directories instead
+     */
+    class WatchHolder {
+    public:
+      struct Candidate {
+        // When the directory last had an event, in seconds since the epoch
+        int64_t active;
+        WatchHolder *holder;
+        int wd;
+      };
+
+      virtual ~WatchHolder() {}
+
+      /*
+       * Add up to `count` of the watches with no event since `idle_before`,
+       * the coldest ones, to `candidates`. Holders that are busy may add
+       * nothing.
+       */
+      virtual void coldest(size_t count, int64_t idle_before, std::vector<Candidate> &candidates) = 0;
+
+      // Poll these directories instead of watching them, returns how many were
+      virtual size_t demote(const std::vector<int> &wds) = 0;
+    };
+
+    /*
+     * Every holder of the process draws on the same per-user kernel budget
+     * (fs.inotify.max_user_watches for inotify). Once it is spent, a holder
+     * that needs a watch, for a new directory or one active again, gets it
+     * by having the coldest directories of all the holders polled instead.
+     */
+    class WatchBudget {
+      std::mutex _mutex;
+      std::vector<WatchHolder *> _holders;
+
+    public:
+      // How long a directory has to go without events to be demoted, so that
+      // watches don't keep moving around
+      static const int64_t min_idle = 60;
+      // Directories demoted at once, for the next ones that need a watch
+      static const size_t batch = 64;
+
+      void add(WatchHolder *holder) {
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        this->_holders.push_back(holder);
+      }
+
+      void remove(WatchHolder *holder) {
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        this->_holders.erase(std::remove(this->_holders.begin(), this->_holders.end(), holder), this->_holders.end());
+      }
+
+      /*
+       * Free at least `count` watches if there are enough cold directories,
+       * `now` being in seconds since the epoch. Returns how many were freed.
+       */
+      size_t reclaim(size_t count, int64_t now) {
+        if (count < batch) {
+          count = batch;
+        }
+
+        std::lock_guard<std::mutex> guard{this->_mutex};
+        std::vector<WatchHolder::Candidate> candidates;
+        for (auto *holder : this->_holders) {
+          holder->coldest(count, now - min_idle, candidates);
+        }
+
+        if (candidates.size() > count) {
+          std::nth_element(candidates.begin(), candidates.begin() + count, candidates.end(), [](const WatchHolder::Candidate &a, const WatchHolder::Candidate &b) {
+            return a.active < b.active;
+          });
+          candidates.resize(count);
+        }
+
+        std::map<WatchHolder *, std::vector<int>> wds;
+        for (auto &candidate : candidates) {
+          wds[candidate.holder].push_back(candidate.wd);
+        }
+
+        size_t freed = 0;
+        for (auto &kv : wds) {
+          freed += kv.first->demote(kv.second);
+        }
+        return freed;
+      }
+    };
+
+    WatchBudget &watch_budget() {
+      static WatchBudget instance;
+      return instance;
+    }
+  }
+}
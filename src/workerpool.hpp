@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+
+namespace fm {
+  namespace land {
+    /*
+     * A fixed set of threads running submitted tasks in order. Tasks must not
+     * wait on other tasks.
+     */
+    class WorkerPool {
+      std::vector<std::thread> _threads;
+      std::deque<std::function<void()>> _tasks;
+      std::mutex _mutex;
+      std::condition_variable _cv;
+      bool _stopping;
+
+      void run() {
+        // Signals are for the threads that asked for them
+        sigset_t set;
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        while (true) {
+          std::function<void()> task;
+          {
+            std::unique_lock<std::mutex> lock{this->_mutex};
+            this->_cv.wait(lock, [this]() { return this->_stopping || !this->_tasks.empty(); });
+            if (this->_tasks.empty()) {
+              return;
+            }
+            task = std::move(this->_tasks.front());
+            this->_tasks.pop_front();
+          }
+
+          task();
+        }
+      }
+
+    public:
+      explicit WorkerPool(size_t threads) : _stopping(false) {
+        for (size_t i = 0; i < threads; ++i) {
+          this->_threads.emplace_back([this]() { this->run(); });
+        }
+      }
+
+      ~WorkerPool() {
+        {
+          std::lock_guard<std::mutex> guard{this->_mutex};
+          this->_stopping = true;
+        }
+        this->_cv.notify_all();
+
+        for (auto &thread : this->_threads) {
+          thread.join();
+        }
+      }
+
+      size_t size() const {
+        return this->_threads.size();
+      }
+
+      template <typename F>
+      auto submit(F f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+        auto future = task->get_future();
+
+        {
+          std::lock_guard<std::mutex> guard{this->_mutex};
+          this->_tasks.emplace_back([task]() { (*task)(); });
+        }
+        this->_cv.notify_one();
+
+        return future;
+      }
+    };
+
+    /*
+     * The pool shared by everything that needs to spread heavy work over a
+     * few cores
+     */
+    WorkerPool &workers() {
+      static WorkerPool pool{std::max(1u, std::min(4u, std::thread::hardware_concurrency()))};
+      return pool;
+    }
+  }
+}